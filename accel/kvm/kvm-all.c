@@ -23,7 +23,11 @@
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -64,9 +68,22 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Address spaces that memslots can be registered in (SMM on x86) */
+#define KVM_DIRTY_RING_MAX_AS   2
+
+/* Exit reasons for which statistics are kept */
+#define KVM_EXIT_REASONS_NB     64
+
+/* Exit latency histogram buckets, one per power of two nanoseconds */
+#define KVM_EXIT_STAT_BUCKETS   32
+
+/* How often the reaper thread harvests the dirty rings */
+#define KVM_DIRTY_RING_REAP_INTERVAL_US     (1000 * 1000)
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t dirty_ring_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -89,6 +106,19 @@ struct KVMState
     int many_ioeventfds;
     int intx_set_mask;
     bool sync_mmu;
+    bool manual_dirty_log_protect;
+    /*
+     * Dirty ring state.  dirty_ring_lock serializes harvesting the
+     * rings against vCPU ring setup/teardown and memslot updates; it
+     * nests inside the BQL and outside cpu_list_lock.  Without the
+     * rings, it also protects the slots' dirty_bmap, which the
+     * migration thread reads in kvm_log_clear() outside the BQL.
+     */
+    uint32_t kvm_dirty_ring_size;       /* entries per vCPU, 0 if unused */
+    uint32_t kvm_dirty_ring_bytes;
+    QemuMutex dirty_ring_lock;
+    KVMMemoryListener *dirty_ring_kml[KVM_DIRTY_RING_MAX_AS];
+    QemuThread dirty_ring_reaper;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -110,6 +140,31 @@ struct KVMState
     int (*memcrypt_encrypt_data)(void *handle, uint8_t *ptr, uint64_t len);
 };
 
+typedef struct KVMExitStat {
+    uint64_t count;
+    uint64_t time_ns;
+    uint64_t bql_contended;
+    uint64_t histogram[KVM_EXIT_STAT_BUCKETS];
+} KVMExitStat;
+
+/* Bounds the per-vCPU address table against guests that scan MMIO */
+#define KVM_EXIT_STATS_MAX_ADDRS 4096
+
+typedef struct KVMExitStats {
+    /* Taken by the vCPU thread for updates and by QMP for reads/resets */
+    QemuMutex lock;
+    KVMExitStat reasons[KVM_EXIT_REASONS_NB];
+    /*
+     * Address of MMIO/PIO exits -> KVMExitStat.  Keys are the address
+     * shifted left by one, with bit 0 set for port I/O.  They are mapped
+     * to memory regions only when the statistics are queried.
+     */
+    GHashTable *addrs;
+} KVMExitStats;
+
+/* Set by set-kvm-exit-stats; nothing is accounted until then */
+static bool kvm_exit_stats_enabled;
+
 KVMState *kvm_state;
 bool kvm_kernel_irqchip;
 bool kvm_split_irqchip;
@@ -281,6 +336,403 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, boo
     return ret;
 }
 
+/* Called with dirty_ring_lock held */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t slot_id,
+                                     uint64_t offset)
+{
+    uint32_t as_id = slot_id >> 16;
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    slot_id &= 0xffff;
+    if (as_id >= KVM_DIRTY_RING_MAX_AS || slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->dirty_ring_kml[as_id];
+    if (!kml) {
+        return;
+    }
+
+    /* The slot may have been removed since the entry was pushed */
+    mem = &kml->slots[slot_id];
+    if (offset >= mem->memory_size / qemu_real_host_page_size) {
+        return;
+    }
+
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * qemu_real_host_page_size,
+                                        qemu_real_host_page_size,
+                                        DIRTY_CLIENTS_NOCODE);
+}
+
+/* Called with dirty_ring_lock held */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfns = cpu->kvm_dirty_gfns;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t count = 0;
+
+    if (!gfns) {
+        return 0;
+    }
+
+    for (;;) {
+        struct kvm_dirty_gfn *cur = &gfns[fetch & (s->kvm_dirty_ring_size - 1)];
+
+        if (!(atomic_load_acquire(&cur->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, cur->slot, cur->offset);
+        /* Hand the entry back to KVM; it is recycled on the next reset */
+        atomic_store_release(&cur->flags, KVM_DIRTY_GFN_F_RESET);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+    stat64_add(&cpu->dirty_pages, count);
+
+    return count;
+}
+
+/* Called with dirty_ring_lock held */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ret;
+
+    cpu_list_lock();
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+    cpu_list_unlock();
+
+    if (total) {
+        /* Re-protect the harvested pages and free up the ring entries */
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            error_report("KVM_RESET_DIRTY_RINGS failed: %s", strerror(-ret));
+            abort();
+        }
+    }
+
+    return total;
+}
+
+/*
+ * Harvest the dirty rings of all vCPUs into the dirty memory bitmaps.
+ * Can be called with or without the BQL.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    uint64_t total;
+
+    qemu_mutex_lock(&s->dirty_ring_lock);
+    total = kvm_dirty_ring_reap_locked(s);
+    qemu_mutex_unlock(&s->dirty_ring_lock);
+
+    return total;
+}
+
+/*
+ * Keep the rings drained while the guest runs, so that vCPUs rarely
+ * have to exit with KVM_EXIT_DIRTY_RING_FULL.
+ */
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL_US);
+        kvm_dirty_ring_reap(s);
+    }
+
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint64_t ring_size)
+{
+    uint64_t ring_bytes = ring_size * sizeof(struct kvm_dirty_gfn);
+    int max_bytes;
+    int ret;
+
+    if (!is_power_of_2(ring_size)) {
+        error_report("dirty-ring-size must be a power of two");
+        return -EINVAL;
+    }
+
+    /*
+     * The rings live at this page offset of the vCPU mapping; the headers
+     * of architectures without dirty ring support leave it at 0.
+     */
+    if (!KVM_DIRTY_LOG_PAGE_OFFSET) {
+        warn_report("KVM dirty ring not supported on this architecture, "
+                    "falling back to the dirty bitmap");
+        return 0;
+    }
+
+    max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0) {
+        warn_report("KVM dirty ring not supported by the host, "
+                    "falling back to the dirty bitmap");
+        return 0;
+    }
+    if (ring_bytes > max_bytes) {
+        error_report("dirty-ring-size %" PRIu64 " is too big, KVM supports "
+                     "at most %zu entries", ring_size,
+                     max_bytes / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret) {
+        warn_report("Enabling KVM_CAP_DIRTY_LOG_RING failed: %s, "
+                    "falling back to the dirty bitmap", strerror(-ret));
+        return 0;
+    }
+
+    s->kvm_dirty_ring_size = ring_size;
+    s->kvm_dirty_ring_bytes = ring_bytes;
+    return 0;
+}
+
+static const char *const kvm_exit_reason_names[KVM_EXIT_REASONS_NB] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_DCR] = "dcr",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_SYSTEM_EVENT] = "system-event",
+    [KVM_EXIT_S390_STSI] = "s390-stsi",
+    [KVM_EXIT_IOAPIC_EOI] = "ioapic-eoi",
+    [KVM_EXIT_HYPERV] = "hyperv",
+    [KVM_EXIT_DIRTY_RING_FULL] = "dirty-ring-full",
+};
+
+static KVMExitStats *kvm_exit_stats_new(void)
+{
+    KVMExitStats *stats = g_new0(KVMExitStats, 1);
+
+    qemu_mutex_init(&stats->lock);
+    stats->addrs = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                         g_free, g_free);
+    return stats;
+}
+
+static void kvm_exit_stats_free(KVMExitStats *stats)
+{
+    g_hash_table_destroy(stats->addrs);
+    qemu_mutex_destroy(&stats->lock);
+    g_free(stats);
+}
+
+static void kvm_exit_stat_add(KVMExitStat *stat, uint64_t ns, bool contended)
+{
+    int bucket = ns ? 63 - clz64(ns) : 0;
+
+    stat->count++;
+    stat->time_ns += ns;
+    stat->bql_contended += contended;
+    stat->histogram[MIN(bucket, KVM_EXIT_STAT_BUCKETS - 1)]++;
+}
+
+static void kvm_exit_stat_merge(KVMExitStat *dst, const KVMExitStat *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->time_ns += src->time_ns;
+    dst->bql_contended += src->bql_contended;
+    for (i = 0; i < KVM_EXIT_STAT_BUCKETS; i++) {
+        dst->histogram[i] += src->histogram[i];
+    }
+}
+
+/*
+ * Account an exit that took @ns to handle.  For MMIO and PIO exits, @as
+ * and @addr identify the access.  Runs without the BQL, so this must not
+ * look at the memory map.
+ */
+static void kvm_exit_stats_account(CPUState *cpu, uint32_t reason,
+                                   AddressSpace *as, hwaddr addr,
+                                   uint64_t ns, bool contended)
+{
+    KVMExitStats *stats = cpu->kvm_exit_stats;
+    KVMExitStat *stat;
+    uint64_t key;
+
+    if (reason >= KVM_EXIT_REASONS_NB) {
+        return;
+    }
+
+    qemu_mutex_lock(&stats->lock);
+    kvm_exit_stat_add(&stats->reasons[reason], ns, contended);
+    if (as) {
+        key = ((uint64_t)addr << 1) | (as == &address_space_io);
+        stat = g_hash_table_lookup(stats->addrs, &key);
+        if (!stat &&
+            g_hash_table_size(stats->addrs) < KVM_EXIT_STATS_MAX_ADDRS) {
+            stat = g_new0(KVMExitStat, 1);
+            g_hash_table_insert(stats->addrs, g_memdup(&key, sizeof(key)),
+                                stat);
+        }
+        if (stat) {
+            kvm_exit_stat_add(stat, ns, contended);
+        }
+    }
+    qemu_mutex_unlock(&stats->lock);
+}
+
+static KvmExitStat *kvm_exit_stat_info(const char *name, KVMExitStat *stat)
+{
+    KvmExitStat *info = g_new0(KvmExitStat, 1);
+    int i;
+
+    info->name = g_strdup(name);
+    info->count = stat->count;
+    info->time_ns = stat->time_ns;
+    info->bql_contended = stat->bql_contended;
+    for (i = KVM_EXIT_STAT_BUCKETS - 1; i >= 0; i--) {
+        intList *entry = g_new0(intList, 1);
+
+        entry->value = stat->histogram[i];
+        entry->next = info->histogram;
+        info->histogram = entry;
+    }
+    return info;
+}
+
+/* Called with the BQL held, which memory_region_name() needs */
+static void kvm_exit_stats_add_addr(gpointer key, gpointer value,
+                                    gpointer opaque)
+{
+    GHashTable *regions = opaque;
+    uint64_t k = *(uint64_t *)key;
+    AddressSpace *as = k & 1 ? &address_space_io : &address_space_memory;
+    hwaddr xlat, len = 1;
+    MemoryRegion *mr;
+    KVMExitStat *stat;
+    const char *name;
+
+    rcu_read_lock();
+    mr = address_space_translate(as, k >> 1, &xlat, &len, false,
+                                 MEMTXATTRS_UNSPECIFIED);
+    name = memory_region_name(mr);
+    stat = g_hash_table_lookup(regions, name);
+    if (!stat) {
+        stat = g_new0(KVMExitStat, 1);
+        g_hash_table_insert(regions, g_strdup(name), stat);
+    }
+    kvm_exit_stat_merge(stat, value);
+    rcu_read_unlock();
+}
+
+static void kvm_exit_stats_add_region(gpointer key, gpointer value,
+                                      gpointer opaque)
+{
+    KvmExitStatList **list = opaque;
+    KvmExitStatList *entry = g_new0(KvmExitStatList, 1);
+
+    entry->value = kvm_exit_stat_info(key, value);
+    entry->next = *list;
+    *list = entry;
+}
+
+void qmp_set_kvm_exit_stats(bool enabled, Error **errp)
+{
+    atomic_set(&kvm_exit_stats_enabled, enabled);
+}
+
+KvmVcpuExitStatsList *qmp_query_kvm_exit_stats(Error **errp)
+{
+    KvmVcpuExitStatsList *head = NULL, **tail = &head;
+    CPUState *cpu;
+    int i;
+
+    CPU_FOREACH(cpu) {
+        KVMExitStats *stats = cpu->kvm_exit_stats;
+        KvmVcpuExitStats *info;
+        GHashTable *regions;
+
+        if (!stats) {
+            continue;
+        }
+
+        info = g_new0(KvmVcpuExitStats, 1);
+        info->cpu_index = cpu->cpu_index;
+        regions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        g_free, g_free);
+
+        qemu_mutex_lock(&stats->lock);
+        for (i = KVM_EXIT_REASONS_NB - 1; i >= 0; i--) {
+            KvmExitStatList *entry;
+            char *name;
+
+            if (!stats->reasons[i].count) {
+                continue;
+            }
+            name = kvm_exit_reason_names[i] ?
+                g_strdup(kvm_exit_reason_names[i]) :
+                g_strdup_printf("exit-%d", i);
+            entry = g_new0(KvmExitStatList, 1);
+            entry->value = kvm_exit_stat_info(name, &stats->reasons[i]);
+            entry->next = info->exits;
+            info->exits = entry;
+            g_free(name);
+        }
+        g_hash_table_foreach(stats->addrs, kvm_exit_stats_add_addr, regions);
+        qemu_mutex_unlock(&stats->lock);
+
+        g_hash_table_foreach(regions, kvm_exit_stats_add_region,
+                             &info->regions);
+        g_hash_table_destroy(regions);
+
+        *tail = g_new0(KvmVcpuExitStatsList, 1);
+        (*tail)->value = info;
+        tail = &(*tail)->next;
+    }
+
+    return head;
+}
+
+void qmp_reset_kvm_exit_stats(Error **errp)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        KVMExitStats *stats = cpu->kvm_exit_stats;
+
+        if (!stats) {
+            continue;
+        }
+        qemu_mutex_lock(&stats->lock);
+        memset(stats->reasons, 0, sizeof(stats->reasons));
+        g_hash_table_remove_all(stats->addrs);
+        qemu_mutex_unlock(&stats->lock);
+    }
+}
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -302,15 +754,33 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        qemu_mutex_lock(&s->dirty_ring_lock);
+        /* Do not lose what the vCPU dirtied last */
+        kvm_dirty_ring_reap_locked(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        cpu->kvm_dirty_gfns = NULL;
+        qemu_mutex_unlock(&s->dirty_ring_lock);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    kvm_exit_stats_free(cpu->kvm_exit_stats);
+    cpu->kvm_exit_stats = NULL;
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    /* KVM keeps the ring of a parked vCPU, so remember where we were */
+    vcpu->dirty_ring_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *dirty_ring_fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -320,11 +790,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *dirty_ring_fetch_index = cpu->dirty_ring_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *dirty_ring_fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -336,7 +808,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -345,6 +817,7 @@ int kvm_init_vcpu(CPUState *cpu)
     cpu->kvm_fd = ret;
     cpu->kvm_state = s;
     cpu->vcpu_dirty = true;
+    cpu->kvm_exit_stats = kvm_exit_stats_new();
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -366,6 +839,20 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        void *gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                          PROT_READ | PROT_WRITE, MAP_SHARED, cpu->kvm_fd,
+                          PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (gfns == MAP_FAILED) {
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+        qemu_mutex_lock(&s->dirty_ring_lock);
+        cpu->kvm_dirty_gfns = gfns;
+        qemu_mutex_unlock(&s->dirty_ring_lock);
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -487,6 +974,15 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     KVMSlot *mem;
     hwaddr start_addr, size;
 
+    if (s->kvm_dirty_ring_size) {
+        /*
+         * The rings are not per-slot; harvesting them covers this
+         * section as well as every other one.
+         */
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+
     size = kvm_align_section(section, &start_addr);
     if (size) {
         mem = kvm_lookup_matching_slot(kml, start_addr, size);
@@ -507,19 +1003,28 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          * So for now, let's align to 64 instead of HOST_LONG_BITS here, in
          * a hope that sizeof(long) won't become >8 any time soon.
          */
-        size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
-                     /*HOST_LONG_BITS*/ 64) / 8;
-        d.dirty_bitmap = g_malloc0(size);
+        qemu_mutex_lock(&s->dirty_ring_lock);
+        if (!mem->dirty_bmap) {
+            size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
+                         /*HOST_LONG_BITS*/ 64) / 8;
+            mem->dirty_bmap = g_malloc0(size);
+        }
+        d.dirty_bitmap = mem->dirty_bmap;
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
-            g_free(d.dirty_bitmap);
+            qemu_mutex_unlock(&s->dirty_ring_lock);
             return -1;
         }
 
+        /*
+         * With manual protection the pages stay writable and stay set in
+         * the kernel bitmap; kvm_log_clear() re-arms them once the
+         * consumer is about to use them.
+         */
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
-        g_free(d.dirty_bitmap);
+        qemu_mutex_unlock(&s->dirty_ring_lock);
     }
 
     return 0;
@@ -752,7 +1257,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         }
 
         /* unregister the slot */
+        qemu_mutex_lock(&kvm_state->dirty_ring_lock);
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         mem->memory_size = 0;
+        qemu_mutex_unlock(&kvm_state->dirty_ring_lock);
         mem->flags = 0;
         err = kvm_set_user_memory_region(kml, mem, false);
         if (err) {
@@ -765,8 +1274,13 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
     /* register the new slot */
     mem = kvm_alloc_slot(kml);
+    qemu_mutex_lock(&kvm_state->dirty_ring_lock);
     mem->memory_size = size;
     mem->start_addr = start_addr;
+    mem->ram_start_offset = memory_region_get_ram_addr(mr) +
+                            section->offset_within_region +
+                            (start_addr - section->offset_within_address_space);
+    qemu_mutex_unlock(&kvm_state->dirty_ring_lock);
     mem->ram = ram;
     mem->flags = kvm_mem_flags(mr);
 
@@ -808,6 +1322,101 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+/* Pages re-protected per KVM_CLEAR_DIRTY_LOG call, must be a multiple of 64 */
+#define KVM_CLEAR_LOG_CHUNK  (1 << 18)
+
+/**
+ * kvm_physical_log_clear - Re-arm dirty tracking for part of a slot
+ *
+ * With KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, KVM_GET_DIRTY_LOG leaves the
+ * pages writable and the kernel bitmap untouched.  Clear and write-protect
+ * the pages of @section that the last KVM_GET_DIRTY_LOG reported, a chunk
+ * at a time, so that vCPUs faulting on the slot only wait for the MMU lock
+ * of one chunk, and chunks without dirty pages cost nothing.
+ *
+ * The kernel wants 64-page aligned ranges, so the range is widened to
+ * that.  Clearing the extra pages is harmless: their dirty bits have
+ * already been copied to the QEMU bitmap by the last sync.
+ *
+ * Called with dirty_ring_lock held.
+ */
+static int kvm_physical_log_clear(KVMMemoryListener *kml,
+                                  MemoryRegionSection *section)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d = {};
+    uint64_t start, end, first, count, npages;
+    hwaddr start_addr, size;
+    KVMSlot *mem = NULL;
+    int i;
+
+    size = kvm_align_section(section, &start_addr);
+    if (!size) {
+        return 0;
+    }
+
+    for (i = 0; i < s->nr_slots; i++) {
+        KVMSlot *slot = &kml->slots[i];
+
+        if (slot->memory_size && start_addr >= slot->start_addr &&
+            start_addr - slot->start_addr < slot->memory_size) {
+            mem = slot;
+            break;
+        }
+    }
+    if (!mem || !mem->dirty_bmap) {
+        /* Not logged, or never synced since the slot was created */
+        return 0;
+    }
+
+    npages = mem->memory_size >> TARGET_PAGE_BITS;
+    start = (start_addr - mem->start_addr) >> TARGET_PAGE_BITS;
+    end = MIN(start + (size >> TARGET_PAGE_BITS), npages);
+    start = QEMU_ALIGN_DOWN(start, 64);
+    end = MIN(QEMU_ALIGN_UP(end, 64), npages);
+
+    d.slot = mem->slot | (kml->as_id << 16);
+    for (first = start; first < end; first += count) {
+        count = MIN(KVM_CLEAR_LOG_CHUNK, end - first);
+        if (find_next_bit(mem->dirty_bmap, first + count, first) >=
+            first + count) {
+            continue;
+        }
+
+        d.first_page = first;
+        d.num_pages = count;
+        d.dirty_bitmap = mem->dirty_bmap + first / BITS_PER_LONG;
+        if (kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d) < 0) {
+            DPRINTF("ioctl failed %d\n", errno);
+            return -1;
+        }
+        /* Don't clear the same pages again before the next sync */
+        bitmap_clear(mem->dirty_bmap, first, count);
+    }
+
+    return 0;
+}
+
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    int r;
+
+    if (!s->manual_dirty_log_protect) {
+        /* KVM_GET_DIRTY_LOG has already re-protected the pages */
+        return;
+    }
+
+    qemu_mutex_lock(&s->dirty_ring_lock);
+    r = kvm_physical_log_clear(kml, section);
+    qemu_mutex_unlock(&s->dirty_ring_lock);
+    if (r < 0) {
+        abort();
+    }
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -884,6 +1493,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < KVM_DIRTY_RING_MAX_AS) {
+        s->dirty_ring_kml[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -894,6 +1506,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1499,6 +2112,8 @@ static int kvm_init(MachineState *ms)
     int ret;
     int type = 0;
     const char *kvm_type;
+    QemuOpts *accel_opts;
+    uint64_t dirty_ring_size = 0;
 
     s = KVM_STATE(ms->accelerator);
 
@@ -1516,6 +2131,7 @@ static int kvm_init(MachineState *ms)
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
     QLIST_INIT(&s->kvm_parked_vcpus);
+    qemu_mutex_init(&s->dirty_ring_lock);
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1616,6 +2232,42 @@ static int kvm_init(MachineState *ms)
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
 
+    /* The dirty ring has to be enabled before any vCPU is created */
+    accel_opts = qemu_opts_find(qemu_find_opts("accel"), NULL);
+    if (accel_opts) {
+        dirty_ring_size = qemu_opt_get_number(accel_opts, "dirty-ring-size", 0);
+    }
+    if (dirty_ring_size) {
+        ret = kvm_dirty_ring_init(s, dirty_ring_size);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    /* KVM_CLEAR_DIRTY_LOG is of no use when the dirty ring is enabled */
+    if (!s->kvm_dirty_ring_size) {
+        int manual_cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2;
+
+        if (!(kvm_check_extension(s, manual_cap) &
+              KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE)) {
+            /* Linux 5.0 and 5.1 only have the original capability */
+            manual_cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT;
+            if (!kvm_check_extension(s, manual_cap)) {
+                manual_cap = 0;
+            }
+        }
+        if (manual_cap) {
+            ret = kvm_vm_enable_cap(s, manual_cap, 0,
+                                    KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE);
+            if (ret) {
+                warn_report("Trying to enable KVM_CAP_MANUAL_DIRTY_LOG_PROTECT "
+                            "but failed.  Falling back to the legacy mode.");
+            } else {
+                s->manual_dirty_log_protect = true;
+            }
+        }
+    }
+
 #ifdef KVM_CAP_VCPU_EVENTS
     s->vcpu_events = kvm_check_extension(s, KVM_CAP_VCPU_EVENTS);
 #endif
@@ -1699,6 +2351,12 @@ static int kvm_init(MachineState *ms)
 
     s->sync_mmu = !!kvm_vm_check_extension(kvm_state, KVM_CAP_SYNC_MMU);
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     return 0;
 
 err:
@@ -1904,6 +2562,13 @@ int kvm_cpu_exec(CPUState *cpu)
 
     do {
         MemTxAttrs attrs;
+        AddressSpace *exit_as = NULL;
+        hwaddr exit_addr = 0;
+        uint32_t exit_reason;
+        uint64_t bql_contended;
+        int64_t exit_start = 0;
+        bool account_exit;
+        bool contended;
 
         if (cpu->vcpu_dirty) {
             kvm_arch_put_registers(cpu, KVM_PUT_RUNTIME_STATE);
@@ -1961,10 +2626,18 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         }
 
-        trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
-        switch (run->exit_reason) {
+        exit_reason = run->exit_reason;
+        trace_kvm_run_exit(cpu->cpu_index, exit_reason);
+        bql_contended = qemu_mutex_iothread_contended();
+        account_exit = atomic_read(&kvm_exit_stats_enabled);
+        if (account_exit) {
+            exit_start = get_clock();
+        }
+        switch (exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
+            exit_as = &address_space_io;
+            exit_addr = run->io.port;
             /* Called outside BQL */
             kvm_handle_io(run->io.port, attrs,
                           (uint8_t *)run + run->io.data_offset,
@@ -1975,6 +2648,8 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
+            exit_as = &address_space_memory;
+            exit_addr = run->mmio.phys_addr;
             /* Called outside BQL */
             address_space_rw(&address_space_memory,
                              run->mmio.phys_addr, attrs,
@@ -2000,6 +2675,15 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * The vCPU cannot make progress until its ring is reset,
+             * so harvest the rings right away instead of waiting for
+             * the reaper thread.
+             */
+            kvm_dirty_ring_reap(kvm_state);
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
@@ -2028,6 +2712,15 @@ int kvm_cpu_exec(CPUState *cpu)
             ret = kvm_arch_handle_exit(cpu, run);
             break;
         }
+
+        contended = qemu_mutex_iothread_contended() != bql_contended;
+        if (contended) {
+            trace_kvm_run_exit_bql_contended(cpu->cpu_index, exit_reason);
+        }
+        if (account_exit) {
+            kvm_exit_stats_account(cpu, exit_reason, exit_as, exit_addr,
+                                   get_clock() - exit_start, contended);
+        }
     } while (ret == 0);
 
     cpu_exec_end(cpu);
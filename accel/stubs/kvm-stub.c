@@ -17,6 +17,7 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/pci/msi.h"
+#include "qapi/qapi-commands-misc.h"
 #endif
 
 KVMState *kvm_state;
@@ -170,4 +171,17 @@ bool kvm_arm_supports_user_irq(void)
 {
     return false;
 }
+
+void qmp_set_kvm_exit_stats(bool enabled, Error **errp)
+{
+}
+
+KvmVcpuExitStatsList *qmp_query_kvm_exit_stats(Error **errp)
+{
+    return NULL;
+}
+
+void qmp_reset_kvm_exit_stats(Error **errp)
+{
+}
 #endif
@@ -14,8 +14,11 @@
 #include "qemu-common.h"
 #include "cpu.h"
 #include "tcg/tcg.h"
+#include "tcg/perf.h"
 #include "exec/cpu-common.h"
 #include "exec/exec-all.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
 
 void tb_flush(CPUState *cpu)
 {
@@ -24,3 +27,30 @@ void tb_flush(CPUState *cpu)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
 }
+
+#ifdef CONFIG_LINUX
+void perf_enable_perfmap(void)
+{
+}
+
+void perf_enable_jitdump(void)
+{
+}
+#endif
+
+void qmp_set_tcg_profile(bool enabled, Error **errp)
+{
+    error_setg(errp, "TCG is not in use");
+}
+
+TcgProfile *qmp_query_tcg_profile(bool has_limit, int64_t limit,
+                                  Error **errp)
+{
+    error_setg(errp, "TCG is not in use");
+    return NULL;
+}
+
+void qmp_reset_tcg_profile(Error **errp)
+{
+    error_setg(errp, "TCG is not in use");
+}
@@ -1188,7 +1188,7 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
 #include "atomic_template.h"
 #endif
 
-#ifdef CONFIG_ATOMIC128
+#ifdef HAVE_ATOMIC128
 #define DATA_SIZE 16
 #include "atomic_template.h"
 #endif
@@ -29,6 +29,8 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg.h"
+#include "tcg/perf.h"
+#include "tcg/profile.h"
 #if defined(CONFIG_USER_ONLY)
 #include "qemu.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1256,6 +1258,7 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
+    perf_report_flush();
     tcg_region_reset_all();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
@@ -1669,6 +1672,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    TBProfile *tb_prof;
+    int64_t tb_prof_start;
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti;
@@ -1697,6 +1702,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
     tcg_ctx->tb_cflags = cflags;
 
+    tb_prof = tcg_profile_lookup(pc);
+    tcg_ctx->tb_exec_count = tb_prof ? &tb_prof->executions : NULL;
+    tb_prof_start = tb_prof ? get_clock() : 0;
+
 #ifdef CONFIG_PROFILER
     /* includes aborted translations because of exceptions */
     atomic_set(&prof->tb_count1, prof->tb_count1 + 1);
@@ -1744,6 +1753,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
     tb->tc.size = gen_code_size;
 
+    if (tb_prof) {
+        tcg_profile_translated(tb_prof, get_clock() - tb_prof_start);
+    }
+
 #ifdef CONFIG_PROFILER
     atomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
     atomic_set(&prof->code_in_len, prof->code_in_len + tb->size);
@@ -1823,6 +1836,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         return existing_tb;
     }
     tcg_tb_insert(tb);
+    perf_report_code(tb);
     return tb;
 }
 
@@ -17,6 +17,8 @@
 #include "qapi/qapi-builtin-visit.h"
 #include "qapi/visitor.h"
 #include "qemu/config-file.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
 #include "qom/object_interfaces.h"
 #include "qemu/mmap-alloc.h"
 
@@ -195,6 +197,21 @@ static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
     return backend->prealloc || backend->force_prealloc;
 }
 
+/*
+ * Host CPUs for the preallocation threads, if the user asked for threads
+ * to follow memory with numa-affinity=on.  Interleaved memory is spread
+ * over all of its nodes whichever CPU touches it, so it is left alone.
+ */
+static unsigned long *host_memory_backend_get_prealloc_cpus(
+    HostMemoryBackend *backend, unsigned long *nbits)
+{
+    if (!current_machine || !current_machine->numa_affinity ||
+        backend->policy == HOST_MEM_POLICY_INTERLEAVE) {
+        return NULL;
+    }
+    return host_memory_backend_get_host_cpus(backend, nbits);
+}
+
 static void host_memory_backend_set_prealloc(Object *obj, bool value,
                                              Error **errp)
 {
@@ -219,7 +236,13 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, smp_cpus, &local_err);
+        unsigned long nbits = 0;
+        unsigned long *cpus =
+            host_memory_backend_get_prealloc_cpus(backend, &nbits);
+
+        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads,
+                        cpus, nbits, &local_err);
+        g_free(cpus);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -228,6 +251,33 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, name, &backend->prealloc_threads, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    backend->prealloc_threads = value;
+}
+
 static void host_memory_backend_init(Object *obj)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -279,6 +329,84 @@ size_t host_memory_backend_pagesize(HostMemoryBackend *memdev)
 }
 #endif
 
+#ifdef CONFIG_LINUX
+/* Set the bits of the CPUs of host NUMA node @node in @cpus */
+static void host_node_add_cpus(unsigned long node, unsigned long *cpus,
+                               unsigned long nbits)
+{
+    char *path;
+    gchar *contents = NULL;
+    const char *p;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        goto out;
+    }
+
+    /* The list looks like "0-3,8-11\n" */
+    p = contents;
+    for (;;) {
+        unsigned long first, last;
+
+        if (qemu_strtoul(p, &p, 10, &first) < 0) {
+            break;
+        }
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0) {
+            break;
+        }
+        for (; first <= last && first < nbits; first++) {
+            set_bit(first, cpus);
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+
+out:
+    g_free(contents);
+    g_free(path);
+}
+
+unsigned long *host_memory_backend_get_host_cpus(HostMemoryBackend *backend,
+                                                 unsigned long *nbits)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    unsigned long *cpus;
+    unsigned long node;
+
+    if (backend->policy == HOST_MEM_POLICY_DEFAULT || ncpus <= 0) {
+        return NULL;
+    }
+
+    cpus = bitmap_new(ncpus);
+    for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+        host_node_add_cpus(node, cpus, ncpus);
+        /* Like mbind(), only the first node counts for "preferred" */
+        if (backend->policy == HOST_MEM_POLICY_PREFERRED) {
+            break;
+        }
+    }
+
+    if (bitmap_empty(cpus, ncpus)) {
+        g_free(cpus);
+        return NULL;
+    }
+
+    *nbits = ncpus;
+    return cpus;
+}
+#else
+unsigned long *host_memory_backend_get_host_cpus(HostMemoryBackend *backend,
+                                                 unsigned long *nbits)
+{
+    return NULL;
+}
+#endif
+
 static void
 host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
 {
@@ -347,8 +475,27 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            smp_cpus, &local_err);
+            unsigned long nbits = 0;
+            unsigned long *cpus =
+                host_memory_backend_get_prealloc_cpus(backend, &nbits);
+
+            /*
+             * Backends created on the command line are populated in the
+             * background while the rest of the command line is processed;
+             * host_memory_backend_prealloc_wait() collects them before
+             * the board is built.
+             */
+            if (!machine_init_done) {
+                backend->prealloc_job =
+                    os_mem_prealloc_start(memory_region_get_fd(&backend->mr),
+                                          ptr, sz, backend->prealloc_threads,
+                                          cpus, nbits, &local_err);
+            } else {
+                os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
+                                backend->prealloc_threads, cpus, nbits,
+                                &local_err);
+            }
+            g_free(cpus);
             if (local_err) {
                 goto out;
             }
@@ -358,6 +505,62 @@ out:
     error_propagate(errp, local_err);
 }
 
+uint64_t host_memory_backend_prealloc_populated(HostMemoryBackend *backend)
+{
+    if (!host_memory_backend_mr_inited(backend) || !backend->prealloc) {
+        return 0;
+    }
+    if (backend->prealloc_job) {
+        return os_mem_prealloc_progress(backend->prealloc_job);
+    }
+    return memory_region_size(&backend->mr);
+}
+
+static void host_memory_backend_prealloc_finish(HostMemoryBackend *backend,
+                                                Error **errp)
+{
+    if (backend->prealloc_job) {
+        os_mem_prealloc_finish(backend->prealloc_job, errp);
+        backend->prealloc_job = NULL;
+    }
+}
+
+static int host_memory_backend_prealloc_wait_one(Object *obj, void *opaque)
+{
+    HostMemoryBackend *backend;
+    Error *local_err = NULL;
+
+    if (!object_dynamic_cast(obj, TYPE_MEMORY_BACKEND)) {
+        return 0;
+    }
+
+    backend = MEMORY_BACKEND(obj);
+    host_memory_backend_prealloc_finish(backend, &local_err);
+    if (local_err) {
+        error_reportf_err(local_err, "memory backend '%s': ",
+                          object_get_canonical_path_component(obj));
+        exit(1);
+    }
+    return 0;
+}
+
+void host_memory_backend_prealloc_wait(void)
+{
+    object_child_foreach(object_get_objects_root(),
+                         host_memory_backend_prealloc_wait_one, NULL);
+}
+
+static void host_memory_backend_unparent(Object *obj)
+{
+    Error *local_err = NULL;
+
+    /* The populate threads must be gone before the memory is unmapped */
+    host_memory_backend_prealloc_finish(MEMORY_BACKEND(obj), &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+}
+
 static bool
 host_memory_backend_can_be_deleted(UserCreatable *uc)
 {
@@ -391,6 +594,7 @@ host_memory_backend_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
 
+    oc->unparent = host_memory_backend_unparent;
     ucc->complete = host_memory_backend_memory_complete;
     ucc->can_be_deleted = host_memory_backend_can_be_deleted;
 
@@ -403,6 +607,10 @@ host_memory_backend_class_init(ObjectClass *oc, void *data)
     object_class_property_add_bool(oc, "prealloc",
         host_memory_backend_get_prealloc,
         host_memory_backend_set_prealloc, &error_abort);
+    object_class_property_add(oc, "prealloc-threads", "int",
+        host_memory_backend_get_prealloc_threads,
+        host_memory_backend_set_prealloc_threads,
+        NULL, NULL, &error_abort);
     object_class_property_add(oc, "size", "int",
         host_memory_backend_get_size,
         host_memory_backend_set_size,
@@ -50,9 +50,11 @@
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
 #include "tcg.h"
+#include "tcg/perf.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
 #include "hw/boards.h"
+#include "sysemu/numa.h"
 
 #ifdef CONFIG_LINUX
 
@@ -78,6 +80,8 @@ int64_t max_advance;
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* highest per-vcpu throttle percentage, see cpu_throttle_set_vcpu() */
+static int vcpu_throttle_percentage;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -165,18 +169,20 @@ bool mttcg_enabled;
  * there are two remaining limitations to check.
  *
  * - The guest can't be oversized (e.g. 64 bit guest on 32 bit host)
- * - The host must have a stronger memory order than the guest
+ * - The guest must describe its memory order with TCG_GUEST_DEFAULT_MO
  *
- * It may be possible in future to support strong guests on weak hosts
- * but that will require tagging all load/stores in a guest with their
- * implicit memory order requirements which would likely slow things
- * down a lot.
+ * A guest with a stronger memory order than the host is fine as long
+ * as it declares it: tcg_gen_req_mo() then emits a barrier for the
+ * orderings the host lacks in front of every guest load/store, and
+ * tcg_optimize() drops the ones an earlier barrier already covers.
+ * Helpers that access guest memory with cpu_ld*() and cpu_st*() get
+ * the same barriers from cpu_req_mo().
  */
 
 static bool check_tcg_memory_orders_compatible(void)
 {
 #if defined(TCG_GUEST_DEFAULT_MO) && defined(TCG_TARGET_DEFAULT_MO)
-    return (TCG_GUEST_DEFAULT_MO & ~TCG_TARGET_DEFAULT_MO) == 0;
+    return true;
 #else
     return false;
 #endif
@@ -224,6 +230,20 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
     } else {
         mttcg_enabled = default_mttcg_enabled();
     }
+
+#ifdef CONFIG_LINUX
+    if (qemu_opt_get_bool(opts, "perfmap", false)) {
+        perf_enable_perfmap();
+    }
+    if (qemu_opt_get_bool(opts, "jitdump", false)) {
+        perf_enable_jitdump();
+    }
+#else
+    if (qemu_opt_get_bool(opts, "perfmap", false) ||
+        qemu_opt_get_bool(opts, "jitdump", false)) {
+        error_setg(errp, "perfmap and jitdump are only supported on Linux");
+    }
+#endif
 }
 
 /* The current number of executed instructions is based on what we
@@ -710,45 +730,61 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+static int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return MAX(atomic_read(&throttle_percentage),
+               atomic_read(&cpu->throttle_percentage));
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
-        return;
-    }
-
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    /* Sleep for our share of the period chosen by cpu_throttle_timer_tick */
+    pct = (double)cpu_throttle_get_vcpu_percentage(cpu) / 100;
+    sleeptime_ns = (long)(pct * opaque.host_ulong);
 
-    qemu_mutex_unlock_iothread();
-    g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
-    qemu_mutex_lock_iothread();
+    if (sleeptime_ns) {
+        qemu_mutex_unlock_iothread();
+        g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
+        qemu_mutex_lock_iothread();
+    }
     atomic_set(&cpu->throttle_thread_scheduled, 0);
 }
 
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
-    double pct;
+    int max_pct = 0;
+    unsigned long period_ns;
+
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, atomic_read(&cpu->throttle_percentage));
+    }
+    atomic_set(&vcpu_throttle_percentage, max_pct);
+    max_pct = MAX(max_pct, atomic_read(&throttle_percentage));
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
+
+    /*
+     * The most throttled vcpu runs for CPU_THROTTLE_TIMESLICE_NS in each
+     * period, the others sleep for a smaller part of the same period.
+     */
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - (double)max_pct / 100);
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_get_vcpu_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -763,9 +799,48 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    int old_max;
+
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, 0);
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+    if (!new_throttle_pct) {
+        /* The timer recomputes the maximum on its next tick */
+        return;
+    }
+
+    old_max = atomic_read(&vcpu_throttle_percentage);
+    while (old_max < new_throttle_pct) {
+        int prev = atomic_cmpxchg(&vcpu_throttle_percentage, old_max,
+                                  new_throttle_pct);
+        if (prev == old_max) {
+            break;
+        }
+        old_max = prev;
+    }
+
+    /* Start the timer if it is not running, without delaying it */
+    timer_mod_anticipate(throttle_timer,
+                         qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                         CPU_THROTTLE_TIMESLICE_NS);
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+
+    cpu_list_lock();
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
+    cpu_list_unlock();
+    atomic_set(&vcpu_throttle_percentage, 0);
 }
 
 bool cpu_throttle_active(void)
@@ -775,7 +850,8 @@ bool cpu_throttle_active(void)
 
 int cpu_throttle_get_percentage(void)
 {
-    return atomic_read(&throttle_percentage);
+    return MAX(atomic_read(&throttle_percentage),
+               atomic_read(&vcpu_throttle_percentage));
 }
 
 void cpu_ticks_init(void)
@@ -861,6 +937,8 @@ void configure_icount(QemuOpts *opts, Error **errp)
 
 static QEMUTimer *tcg_kick_vcpu_timer;
 static CPUState *tcg_current_rr_cpu;
+/* vCPU whose time slice the kick timer currently measures */
+static CPUState *tcg_rr_slice_cpu;
 
 #define TCG_KICK_PERIOD (NANOSECONDS_PER_SECOND / 10)
 
@@ -913,6 +991,8 @@ void qemu_timer_notify_cb(void *opaque, QEMUClockType type)
 static void kick_tcg_thread(void *opaque)
 {
     timer_mod(tcg_kick_vcpu_timer, qemu_tcg_next_kick());
+    /* The next vCPU to run starts a new slice, even if it is the same */
+    tcg_rr_slice_cpu = NULL;
     qemu_cpu_kick_rr_cpu();
 }
 
@@ -932,6 +1012,7 @@ static void stop_tcg_kick_timer(void)
     if (tcg_kick_vcpu_timer) {
         timer_del(tcg_kick_vcpu_timer);
         tcg_kick_vcpu_timer = NULL;
+        tcg_rr_slice_cpu = NULL;
     }
 }
 
@@ -1348,23 +1429,30 @@ static void process_icount_data(CPUState *cpu)
 }
 
 
-static int tcg_cpu_exec(CPUState *cpu)
+/*
+ * @clock is the host time at which the slice started, or 0 to read it
+ * here.  It is updated to the end of the slice, so that a thread running
+ * slices back to back reads the clock once per slice.
+ */
+static int tcg_cpu_exec(CPUState *cpu, int64_t *clock)
 {
     int ret;
-#ifdef CONFIG_PROFILER
-    int64_t ti;
-#endif
+    int64_t now;
 
     assert(tcg_enabled());
-#ifdef CONFIG_PROFILER
-    ti = profile_getclock();
-#endif
+    if (!*clock) {
+        *clock = get_clock();
+    }
     cpu_exec_start(cpu);
     ret = cpu_exec(cpu);
     cpu_exec_end(cpu);
+    now = get_clock();
+    stat64_add(&cpu->exec_time_ns, now - *clock);
+    stat64_add(&cpu->exec_slices, 1);
 #ifdef CONFIG_PROFILER
-    tcg_time += profile_getclock() - ti;
+    tcg_time += now - *clock;
 #endif
+    *clock = now;
     return ret;
 }
 
@@ -1385,6 +1473,50 @@ static void deal_with_unplugged_cpus(void)
     }
 }
 
+/* Pick the vCPU to resume round-robin scheduling with.  A halted vCPU
+ * that has just been sent an interrupt goes first, so that an IPI or a
+ * device interrupt does not wait for every other vCPU to use up its
+ * time slice.  Record/replay needs a deterministic scheduling order and
+ * keeps the plain rotation.
+ */
+static CPUState *tcg_rr_next_cpu(CPUState *cpu)
+{
+    CPUState *next = cpu;
+
+    if (replay_mode != REPLAY_MODE_NONE) {
+        return cpu;
+    }
+
+    /* Start after @cpu, so that a busy vCPU cannot starve later ones */
+    do {
+        next = CPU_NEXT(next) ?: first_cpu;
+        if (next->halted && cpu_has_work(next) && cpu_can_run(next)) {
+            return next;
+        }
+    } while (next != cpu);
+    return cpu;
+}
+
+/*
+ * Arm the kick timer for a slice of @cpu, whose length is TCG_KICK_PERIOD
+ * scaled by the tcg-weight of the vCPU.  Nothing changes while the same
+ * vCPU keeps running.  Record/replay keeps the fixed period.
+ */
+static void tcg_rr_start_slice(CPUState *cpu)
+{
+    int64_t slice;
+
+    if (cpu == tcg_rr_slice_cpu || !tcg_kick_vcpu_timer ||
+        replay_mode != REPLAY_MODE_NONE) {
+        return;
+    }
+    tcg_rr_slice_cpu = cpu;
+    slice = muldiv64(TCG_KICK_PERIOD, MAX(cpu->tcg_weight, 1),
+                     TCG_DEFAULT_WEIGHT);
+    timer_mod(tcg_kick_vcpu_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + slice);
+}
+
 /* Single-threaded TCG
  *
  * In the single-threaded case each vCPU is simulated in turn. If
@@ -1392,11 +1524,15 @@ static void deal_with_unplugged_cpus(void)
  * the vCPU and ensure we don't get stuck in a tight loop in one vCPU.
  * This is done explicitly rather than relying on side-effects
  * elsewhere.
+ *
+ * Halted vCPUs without pending work are skipped without entering
+ * cpu_exec(), and a halted vCPU that gets woken up is scheduled next.
  */
 
 static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
+    int64_t exec_clock = 0;
 
     assert(tcg_enabled());
     rcu_register_thread();
@@ -1445,6 +1581,9 @@ static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
         if (!cpu) {
             cpu = first_cpu;
         }
+        cpu = tcg_rr_next_cpu(cpu);
+        /* Timers and I/O ran since the last slice, don't charge them */
+        exec_clock = 0;
 
         while (cpu && !cpu->queued_work_first && !cpu->exit_request) {
 
@@ -1457,10 +1596,16 @@ static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
             if (cpu_can_run(cpu)) {
                 int r;
 
+                if (cpu->halted && !cpu_has_work(cpu)) {
+                    cpu = CPU_NEXT(cpu);
+                    continue;
+                }
+
+                tcg_rr_start_slice(cpu);
                 qemu_mutex_unlock_iothread();
                 prepare_icount_for_run(cpu);
 
-                r = tcg_cpu_exec(cpu);
+                r = tcg_cpu_exec(cpu, &exec_clock);
 
                 process_icount_data(cpu);
                 qemu_mutex_lock_iothread();
@@ -1632,6 +1777,7 @@ static void CALLBACK dummy_apc_func(ULONG_PTR unused)
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
+    int64_t exec_clock = 0;
 
     assert(tcg_enabled());
     g_assert(!use_icount);
@@ -1655,7 +1801,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
         if (cpu_can_run(cpu)) {
             int r;
             qemu_mutex_unlock_iothread();
-            r = tcg_cpu_exec(cpu);
+            r = tcg_cpu_exec(cpu, &exec_clock);
             qemu_mutex_lock_iothread();
             switch (r) {
             case EXCP_DEBUG:
@@ -1682,6 +1828,10 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
         }
 
         atomic_mb_set(&cpu->exit_request, 0);
+        if (cpu_thread_is_idle(cpu)) {
+            /* Don't count the sleep in the next slice */
+            exec_clock = 0;
+        }
         qemu_wait_io_event(cpu);
     } while (!cpu->unplug || cpu_can_run(cpu));
 
@@ -1762,13 +1912,24 @@ bool qemu_mutex_iothread_locked(void)
     return iothread_locked;
 }
 
+/* Number of times this thread found the BQL taken by somebody else */
+static __thread uint64_t iothread_lock_contended;
+
 void qemu_mutex_lock_iothread(void)
 {
     g_assert(!qemu_mutex_iothread_locked());
-    qemu_mutex_lock(&qemu_global_mutex);
+    if (qemu_mutex_trylock(&qemu_global_mutex)) {
+        iothread_lock_contended++;
+        qemu_mutex_lock(&qemu_global_mutex);
+    }
     iothread_locked = true;
 }
 
+uint64_t qemu_mutex_iothread_contended(void)
+{
+    return iothread_lock_contended;
+}
+
 void qemu_mutex_unlock_iothread(void)
 {
     g_assert(qemu_mutex_iothread_locked());
@@ -2014,6 +2175,11 @@ void qemu_init_vcpu(CPUState *cpu)
     while (!cpu->created) {
         qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
     }
+
+    /* Round-robin TCG runs all vCPUs in one thread, leave it alone */
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled()) {
+        numa_cpu_set_affinity(cpu);
+    }
 }
 
 void cpu_stop_current(void)
@@ -2273,6 +2439,13 @@ CpuInfoFastList *qmp_query_cpus_fast(Error **errp)
             info->value->props = props;
         }
 
+        if (tcg_enabled()) {
+            info->value->has_exec_time_ns = true;
+            info->value->exec_time_ns = stat64_get(&cpu->exec_time_ns);
+            info->value->has_exec_slices = true;
+            info->value->exec_slices = stat64_get(&cpu->exec_slices);
+        }
+
         info->value->arch = sysemu_target_to_cpuinfo_arch(target);
         info->value->target = target;
         if (target == SYS_EMU_TARGET_S390X) {
@@ -189,13 +189,27 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/* Number of recently used sections remembered by each dispatch */
+#define MRU_SECTIONS_NB 4
+
 struct AddressSpaceDispatch {
-    MemoryRegionSection *mru_section;
+    /* Recently used sections; entries are replaced round-robin on a miss,
+     * so that a hit never dirties the cache line.
+     */
+    MemoryRegionSection *mru_section[MRU_SECTIONS_NB];
+    unsigned mru_next;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
+    /* The nodes before compaction, from which the next dispatch of the
+     * same root can be derived, and the number of sections left unused
+     * by such derivations.
+     */
+    PhysPageEntry build_phys_map;
+    Node *build_nodes;
+    unsigned unused_sections;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -278,9 +292,21 @@ static void phys_page_set_level(PhysPageMap *map, PhysPageEntry *lp,
 {
     PhysPageEntry *p;
     hwaddr step = (hwaddr)1 << (level * P_L2_BITS);
+    int i;
 
     if (lp->skip && lp->ptr == PHYS_MAP_NODE_NIL) {
         lp->ptr = phys_map_node_alloc(map, level == 0);
+    } else if (!lp->skip) {
+        /* A derived dispatch may need to split a larger leaf */
+        uint16_t old_leaf = lp->ptr;
+
+        lp->ptr = phys_map_node_alloc(map, level == 0);
+        lp->skip = 1;
+        p = map->nodes[lp->ptr];
+        for (i = 0; i < P_L2_SIZE; i++) {
+            p[i].skip = 0;
+            p[i].ptr = old_leaf;
+        }
     }
     p = map->nodes[lp->ptr];
     lp = &p[(*index >> (level * P_L2_BITS)) & (P_L2_SIZE - 1)];
@@ -363,6 +389,8 @@ static void phys_page_compact(PhysPageEntry *lp, Node *nodes)
 
 void address_space_dispatch_compact(AddressSpaceDispatch *d)
 {
+    d->build_phys_map = d->phys_map;
+    d->build_nodes = g_memdup(d->map.nodes, d->map.nodes_nb * sizeof(Node));
     if (d->phys_map.skip) {
         phys_page_compact(&d->phys_map, d->map.nodes);
     }
@@ -413,14 +441,32 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = atomic_read(&d->mru_section);
+    MemoryRegionSection *section;
     subpage_t *subpage;
+    int i;
 
-    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
-        !section_covers_addr(section, addr)) {
-        section = phys_page_find(d, addr);
-        atomic_set(&d->mru_section, section);
+    /* Device DMA tends to alternate between a handful of sections (e.g.
+     * RAM below and above 4G, or descriptor rings and packet buffers in
+     * different regions), which would keep evicting a single MRU entry.
+     */
+    for (i = 0; i < MRU_SECTIONS_NB; i++) {
+        section = atomic_read(&d->mru_section[i]);
+        if (section && section_covers_addr(section, addr)) {
+            goto found;
+        }
     }
+
+    section = phys_page_find(d, addr);
+    /* The unassigned section covers the whole address space */
+    if (section != &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+        /* Racing updates may pick the same slot; that is harmless */
+        unsigned next = atomic_read(&d->mru_next);
+
+        atomic_set(&d->mru_next, next + 1);
+        atomic_set(&d->mru_section[next % MRU_SECTIONS_NB], section);
+    }
+
+found:
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
@@ -935,6 +981,131 @@ AddressSpace *cpu_get_address_space(CPUState *cpu, int asidx)
     /* Return the AddressSpace corresponding to the specified index */
     return cpu->cpu_ases[asidx].as;
 }
+
+/*
+ * When a TCG vCPU writes to a clean page, the page is not marked dirty in
+ * the global bitmaps right away; with MTTCG the atomic updates to words
+ * shared by all vCPUs would bounce cache lines between the vCPU threads.
+ * Instead the page is appended to a per-vCPU log, which is merged into
+ * the DIRTY_MEMORY_MIGRATION and DIRTY_MEMORY_VGA bitmaps in batches:
+ * when it fills up, and whenever somebody reads those bitmaps.
+ * DIRTY_MEMORY_CODE is not affected.
+ */
+#define CPU_DIRTY_LOG_SIZE 512
+
+typedef struct CPUDirtyLog {
+    QemuSpin lock;
+    unsigned int count;
+    ram_addr_t pages[CPU_DIRTY_LOG_SIZE];
+} CPUDirtyLog;
+
+static int cpu_dirty_log_cmp(const void *a, const void *b)
+{
+    ram_addr_t pa = *(const ram_addr_t *)a;
+    ram_addr_t pb = *(const ram_addr_t *)b;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+static inline void cpu_dirty_log_set_word(unsigned long *p,
+                                          unsigned long mask)
+{
+    /* Do not take the cache line exclusive if nothing changes */
+    if ((atomic_read(p) & mask) != mask) {
+        atomic_or(p, mask);
+    }
+}
+
+/* Called with log->lock held, within RCU critical section.  */
+static void cpu_dirty_log_flush_locked(CPUDirtyLog *log)
+{
+    unsigned long **migration, **vga;
+    unsigned int i = 0;
+
+    if (!log->count) {
+        return;
+    }
+
+    /*
+     * Sort the log so that pages sharing a bitmap word are merged into a
+     * single update.  The barrier orders the guest's writes to the pages
+     * before the test in cpu_dirty_log_set_word(), so that a concurrent
+     * reader that clears the bits also sees the new page contents.
+     */
+    qsort(log->pages, log->count, sizeof(log->pages[0]), cpu_dirty_log_cmp);
+    smp_mb();
+
+    migration = atomic_rcu_read(
+        &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
+    vga = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_VGA])->blocks;
+
+    while (i < log->count) {
+        ram_addr_t page = log->pages[i];
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long word = BIT_WORD(page % DIRTY_MEMORY_BLOCK_SIZE);
+        unsigned long mask = 0;
+
+        do {
+            mask |= BIT_MASK(log->pages[i]);
+            i++;
+        } while (i < log->count &&
+                 BIT_WORD(log->pages[i]) == BIT_WORD(page));
+
+        cpu_dirty_log_set_word(&migration[idx][word], mask);
+        cpu_dirty_log_set_word(&vga[idx][word], mask);
+    }
+    log->count = 0;
+}
+
+/*
+ * Called from the vCPU thread, within RCU critical section.
+ * Returns the number of pages added to the log.
+ */
+static unsigned int cpu_dirty_log_add(CPUDirtyLog *log, ram_addr_t start,
+                                      ram_addr_t length)
+{
+    ram_addr_t page = start >> TARGET_PAGE_BITS;
+    ram_addr_t last = (start + length - 1) >> TARGET_PAGE_BITS;
+    unsigned int added = 0;
+
+    qemu_spin_lock(&log->lock);
+    for (; page <= last; page++) {
+        if (log->count && log->pages[log->count - 1] == page) {
+            continue;
+        }
+        if (log->count == CPU_DIRTY_LOG_SIZE) {
+            cpu_dirty_log_flush_locked(log);
+        }
+        log->pages[log->count] = page;
+        atomic_set(&log->count, log->count + 1);
+        added++;
+    }
+    qemu_spin_unlock(&log->lock);
+    return added;
+}
+
+void cpu_physical_memory_dirty_log_flush(void)
+{
+    CPUState *cpu;
+
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    rcu_read_lock();
+    cpu_list_lock();
+    CPU_FOREACH(cpu) {
+        CPUDirtyLog *log = cpu->dirty_log;
+
+        if (log && atomic_read(&log->count)) {
+            qemu_spin_lock(&log->lock);
+            cpu_dirty_log_flush_locked(log);
+            qemu_spin_unlock(&log->lock);
+        }
+    }
+    cpu_list_unlock();
+    rcu_read_unlock();
+}
 #endif
 
 void cpu_exec_unrealizefn(CPUState *cpu)
@@ -951,6 +1122,17 @@ void cpu_exec_unrealizefn(CPUState *cpu)
     }
 #ifndef CONFIG_USER_ONLY
     tcg_iommu_free_notifier_list(cpu);
+
+    /* Removed from the CPU list, so nobody else can flush the log now */
+    if (cpu->dirty_log) {
+        rcu_read_lock();
+        qemu_spin_lock(&cpu->dirty_log->lock);
+        cpu_dirty_log_flush_locked(cpu->dirty_log);
+        qemu_spin_unlock(&cpu->dirty_log->lock);
+        rcu_read_unlock();
+        g_free(cpu->dirty_log);
+        cpu->dirty_log = NULL;
+    }
 #endif
 }
 
@@ -964,6 +1146,8 @@ Property cpu_common_props[] = {
      */
     DEFINE_PROP_LINK("memory", CPUState, memory, TYPE_MEMORY_REGION,
                      MemoryRegion *),
+    DEFINE_PROP_UINT32("tcg-weight", CPUState, tcg_weight,
+                       TCG_DEFAULT_WEIGHT),
 #endif
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1001,6 +1185,11 @@ void cpu_exec_realizefn(CPUState *cpu, Error **errp)
     }
 
     cpu->iommu_notifiers = g_array_new(false, true, sizeof(TCGIOMMUNotifier));
+
+    if (tcg_enabled()) {
+        cpu->dirty_log = g_new0(CPUDirtyLog, 1);
+        qemu_spin_init(&cpu->dirty_log->lock);
+    }
 #endif
 }
 
@@ -1365,9 +1554,9 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
 }
 
 /* Note: start and end must be within the same ram block.  */
-bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
-                                              ram_addr_t length,
-                                              unsigned client)
+bool cpu_physical_memory_test_and_clear_dirty_noflush(ram_addr_t start,
+                                                      ram_addr_t length,
+                                                      unsigned client)
 {
     DirtyMemoryBlocks *blocks;
     unsigned long end, page;
@@ -1403,6 +1592,17 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client)
+{
+    if (length && client != DIRTY_MEMORY_CODE) {
+        cpu_physical_memory_dirty_log_flush();
+    }
+    return cpu_physical_memory_test_and_clear_dirty_noflush(start, length,
+                                                            client);
+}
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
      (ram_addr_t start, ram_addr_t length, unsigned client)
 {
@@ -1422,6 +1622,10 @@ DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     end  = last  >> TARGET_PAGE_BITS;
     dest = 0;
 
+    if (client != DIRTY_MEMORY_CODE) {
+        cpu_physical_memory_dirty_log_flush();
+    }
+
     rcu_read_lock();
 
     blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
@@ -1577,7 +1781,8 @@ static void phys_sections_free(PhysPageMap *map)
     g_free(map->nodes);
 }
 
-static void register_subpage(FlatView *fv, MemoryRegionSection *section)
+static void register_subpage(FlatView *fv, MemoryRegionSection *section,
+                             bool remove)
 {
     AddressSpaceDispatch *d = flatview_to_dispatch(fv);
     subpage_t *subpage;
@@ -1590,6 +1795,16 @@ static void register_subpage(FlatView *fv, MemoryRegionSection *section)
     };
     hwaddr start, end;
 
+    start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
+    end = start + int128_get64(section->size) - 1;
+    if (remove) {
+        if (existing->mr->subpage) {
+            subpage = container_of(existing->mr, subpage_t, iomem);
+            subpage_register(subpage, start, end, PHYS_SECTION_UNASSIGNED);
+        }
+        return;
+    }
+
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
@@ -1601,27 +1816,29 @@ static void register_subpage(FlatView *fv, MemoryRegionSection *section)
     } else {
         subpage = container_of(existing->mr, subpage_t, iomem);
     }
-    start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
-    end = start + int128_get64(section->size) - 1;
     subpage_register(subpage, start, end,
                      phys_section_add(&d->map, section));
 }
 
 
 static void register_multipage(FlatView *fv,
-                               MemoryRegionSection *section)
+                               MemoryRegionSection *section, bool remove)
 {
     AddressSpaceDispatch *d = flatview_to_dispatch(fv);
     hwaddr start_addr = section->offset_within_address_space;
-    uint16_t section_index = phys_section_add(&d->map, section);
+    uint16_t section_index;
     uint64_t num_pages = int128_get64(int128_rshift(section->size,
                                                     TARGET_PAGE_BITS));
 
     assert(num_pages);
+    section_index = remove ? PHYS_SECTION_UNASSIGNED
+                           : phys_section_add(&d->map, section);
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
-void flatview_add_to_dispatch(FlatView *fv, MemoryRegionSection *section)
+static void flatview_update_dispatch(FlatView *fv,
+                                     MemoryRegionSection *section,
+                                     bool remove)
 {
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
@@ -1631,7 +1848,7 @@ void flatview_add_to_dispatch(FlatView *fv, MemoryRegionSection *section)
                        - now.offset_within_address_space;
 
         now.size = int128_min(int128_make64(left), now.size);
-        register_subpage(fv, &now);
+        register_subpage(fv, &now, remove);
     } else {
         now.size = int128_zero();
     }
@@ -1641,17 +1858,27 @@ void flatview_add_to_dispatch(FlatView *fv, MemoryRegionSection *section)
         remain.offset_within_region += int128_get64(now.size);
         now = remain;
         if (int128_lt(remain.size, page_size)) {
-            register_subpage(fv, &now);
+            register_subpage(fv, &now, remove);
         } else if (remain.offset_within_address_space & ~TARGET_PAGE_MASK) {
             now.size = page_size;
-            register_subpage(fv, &now);
+            register_subpage(fv, &now, remove);
         } else {
             now.size = int128_and(now.size, int128_neg(page_size));
-            register_multipage(fv, &now);
+            register_multipage(fv, &now, remove);
         }
     }
 }
 
+void flatview_add_to_dispatch(FlatView *fv, MemoryRegionSection *section)
+{
+    flatview_update_dispatch(fv, section, false);
+}
+
+void flatview_remove_from_dispatch(FlatView *fv, MemoryRegionSection *section)
+{
+    flatview_update_dispatch(fv, section, true);
+}
+
 void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
@@ -1893,7 +2120,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory, smp_cpus, errp);
+        os_mem_prealloc(fd, area, memory, smp_cpus, NULL, 0, errp);
         if (errp && *errp) {
             qemu_ram_munmap(area, memory);
             return NULL;
@@ -1994,6 +2221,11 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb)
+{
+    return rb->used_length;
+}
+
 bool qemu_ram_is_shared(RAMBlock *rb)
 {
     return rb->flags & RAM_SHARED;
@@ -2686,6 +2918,8 @@ void memory_notdirty_write_prepare(NotDirtyInfo *ndi,
 /* Called within RCU critical section. */
 void memory_notdirty_write_complete(NotDirtyInfo *ndi)
 {
+    bool dirty;
+
     if (ndi->pages) {
         assert(tcg_enabled());
         page_collection_unlock(ndi->pages);
@@ -2695,11 +2929,21 @@ void memory_notdirty_write_complete(NotDirtyInfo *ndi)
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
-    cpu_physical_memory_set_dirty_range(ndi->ram_addr, ndi->size,
-                                        DIRTY_CLIENTS_NOCODE);
+    if (ndi->cpu->dirty_log) {
+        /* The VGA and migration bits are as good as set once logged */
+        stat64_add(&ndi->cpu->dirty_pages,
+                   cpu_dirty_log_add(ndi->cpu->dirty_log, ndi->ram_addr,
+                                     ndi->size));
+        dirty = cpu_physical_memory_get_dirty_flag(ndi->ram_addr,
+                                                   DIRTY_MEMORY_CODE);
+    } else {
+        cpu_physical_memory_set_dirty_range(ndi->ram_addr, ndi->size,
+                                            DIRTY_CLIENTS_NOCODE);
+        dirty = !cpu_physical_memory_is_clean(ndi->ram_addr);
+    }
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (!cpu_physical_memory_is_clean(ndi->ram_addr)) {
+    if (dirty) {
         tlb_set_dirty(ndi->cpu, ndi->mem_vaddr);
     }
 }
@@ -3068,9 +3312,76 @@ AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
     return d;
 }
 
+static bool section_in_list(MemoryRegionSection *section,
+                            MemoryRegionSection *list, unsigned nr)
+{
+    unsigned i;
+
+    for (i = 0; i < nr; i++) {
+        hwaddr start = list[i].offset_within_address_space;
+
+        if (section->mr == list[i].mr
+            && section->offset_within_address_space >= start
+            && int128_lt(int128_make64(section->offset_within_address_space
+                                       - start), list[i].size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+AddressSpaceDispatch *address_space_dispatch_derive(FlatView *fv,
+                                                    AddressSpaceDispatch *old,
+                                                    MemoryRegionSection *removed,
+                                                    unsigned nr_removed)
+{
+    AddressSpaceDispatch *d;
+    unsigned i;
+
+    /* Sections of removed ranges stay allocated, so that indices in the
+     * nodes remain valid; start afresh once they are too many.
+     */
+    if (!old->build_nodes ||
+        (old->unused_sections + nr_removed) * 2 > old->map.sections_nb ||
+        old->map.sections_nb > TARGET_PAGE_SIZE / 2) {
+        return NULL;
+    }
+
+    d = g_new0(AddressSpaceDispatch, 1);
+    d->unused_sections = old->unused_sections;
+    d->map.sections_nb = d->map.sections_nb_alloc = old->map.sections_nb;
+    d->map.sections = g_new(MemoryRegionSection, d->map.sections_nb);
+    for (i = 0; i < old->map.sections_nb; i++) {
+        MemoryRegionSection *section = &d->map.sections[i];
+
+        *section = old->map.sections[i];
+        section->fv = fv;
+        if (section->mr->subpage) {
+            subpage_t *subpage = container_of(section->mr, subpage_t, iomem);
+            subpage_t *copy = subpage_init(fv, subpage->base);
+
+            memcpy(copy->sub_section, subpage->sub_section,
+                   TARGET_PAGE_SIZE * sizeof(uint16_t));
+            section->mr = &copy->iomem;
+        } else if (section_in_list(section, removed, nr_removed)) {
+            /* Do not keep the region alive; nothing points here anymore */
+            *section = d->map.sections[PHYS_SECTION_UNASSIGNED];
+            d->unused_sections++;
+        }
+        memory_region_ref(section->mr);
+    }
+
+    d->map.nodes_nb = d->map.nodes_nb_alloc = old->map.nodes_nb;
+    d->map.nodes = g_memdup(old->build_nodes, old->map.nodes_nb * sizeof(Node));
+    d->phys_map = old->build_phys_map;
+
+    return d;
+}
+
 void address_space_dispatch_free(AddressSpaceDispatch *d)
 {
     phys_sections_free(&d->map);
+    g_free(d->build_nodes);
     g_free(d);
 }
 
@@ -4143,6 +4454,12 @@ void mtree_print_dispatch(fprintf_function mon, void *f,
         MemoryRegionSection *s = d->map.sections + i;
         const char *names[] = { " [unassigned]", " [not dirty]",
                                 " [ROM]", " [watch]" };
+        bool mru = false;
+        int j;
+
+        for (j = 0; j < MRU_SECTIONS_NB; j++) {
+            mru |= s == d->mru_section[j];
+        }
 
         mon(f, "      #%d @" TARGET_FMT_plx ".." TARGET_FMT_plx " %s%s%s%s%s",
             i,
@@ -4151,7 +4468,7 @@ void mtree_print_dispatch(fprintf_function mon, void *f,
             s->mr->name ? s->mr->name : "(noname)",
             i < ARRAY_SIZE(names) ? names[i] : "",
             s->mr == root ? " [ROOT]" : "",
-            s == d->mru_section ? " [MRU]" : "",
+            mru ? " [MRU]" : "",
             s->mr->is_iommu ? " [iommu]" : "");
 
         if (s->mr->alias) {
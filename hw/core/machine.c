@@ -247,6 +247,20 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_numa_affinity(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->numa_affinity;
+}
+
+static void machine_set_numa_affinity(Object *obj, bool value, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->numa_affinity = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -595,6 +609,12 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "mem-merge",
         "Enable/disable memory merge support", &error_abort);
 
+    object_class_property_add_bool(oc, "numa-affinity",
+        machine_get_numa_affinity, machine_set_numa_affinity, &error_abort);
+    object_class_property_set_description(oc, "numa-affinity",
+        "Run vCPU and I/O threads on the host NUMA nodes backing their "
+        "guest NUMA node", &error_abort);
+
     object_class_property_add_bool(oc, "usb",
         machine_get_usb, machine_set_usb, &error_abort);
     object_class_property_set_description(oc, "usb",
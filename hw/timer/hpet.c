@@ -69,6 +69,10 @@ typedef struct HPETState {
     /*< public >*/
 
     MemoryRegion iomem;
+    /* Main counter registers, read without the global lock */
+    MemoryRegion counter_iomem;
+    /* Protects config, hpet_offset and hpet_counter against counter_iomem */
+    QemuMutex lock;
     uint64_t hpet_offset;
     bool hpet_offset_saved;
     qemu_irq irqs[HPET_NUM_IRQ_ROUTES];
@@ -603,6 +607,7 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             return;
         case HPET_CFG:
             val = hpet_fixup_reg(new_val, old_val, HPET_CFG_WRITE_MASK);
+            qemu_mutex_lock(&s->lock);
             s->config = (s->config & 0xffffffff00000000ULL) | val;
             if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
                 /* Enable main counter and interrupt generation. */
@@ -620,6 +625,7 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
                     hpet_del_timer(&s->timer[i]);
                 }
             }
+            qemu_mutex_unlock(&s->lock);
             /* i8254 and RTC output pins are disabled
              * when HPET is in legacy mode */
             if (activating_bit(old_val, new_val, HPET_CFG_LEGACY)) {
@@ -678,6 +684,32 @@ static const MemoryRegionOps hpet_ram_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/*
+ * Guests using the HPET as clocksource read the main counter all the
+ * time.  These accesses only need config, hpet_offset and hpet_counter,
+ * so they are handled under s->lock instead of the global lock.
+ */
+static uint64_t hpet_counter_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return hpet_ram_read(opaque, HPET_COUNTER + addr, size);
+}
+
+static void hpet_counter_write(void *opaque, hwaddr addr,
+                               uint64_t value, unsigned size)
+{
+    hpet_ram_write(opaque, HPET_COUNTER + addr, value, size);
+}
+
+static const MemoryRegionOps hpet_counter_ops = {
+    .read = hpet_counter_read,
+    .write = hpet_counter_write,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
 static void hpet_reset(DeviceState *d)
 {
     HPETState *s = HPET(d);
@@ -731,8 +763,15 @@ static void hpet_init(Object *obj)
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
     HPETState *s = HPET(obj);
 
+    qemu_mutex_init(&s->lock);
+
     /* HPET Area */
     memory_region_init_io(&s->iomem, obj, &hpet_ram_ops, s, "hpet", HPET_LEN);
+    memory_region_init_io(&s->counter_iomem, obj, &hpet_counter_ops, s,
+                          "hpet-counter", 8);
+    memory_region_set_lock(&s->counter_iomem, &s->lock);
+    memory_region_add_subregion_overlap(&s->iomem, HPET_COUNTER,
+                                        &s->counter_iomem, 1);
     sysbus_init_mmio(sbd, &s->iomem);
 }
 
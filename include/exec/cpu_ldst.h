@@ -72,6 +72,33 @@ static inline int guest_range_valid(unsigned long start, unsigned long len)
 
 #endif
 
+/* The memory helpers for tcg-generated code need tcg_target_long etc.  */
+#include "tcg.h"
+#include "exec/exec-all.h"
+
+/* Accesses made by helpers through the functions below, or through the
+ * cputlb slow path, happen outside the generated code that
+ * tcg_gen_req_mo() orders.  Give them the orderings that the guest
+ * requires and the host lacks, as for the accesses done by generated
+ * code.
+ */
+static inline void cpu_req_mo(TCGBar type)
+{
+#if defined(TCG_GUEST_DEFAULT_MO) && defined(TCG_TARGET_DEFAULT_MO)
+    type &= TCG_GUEST_DEFAULT_MO & ~TCG_TARGET_DEFAULT_MO;
+    if (!type || !parallel_cpus) {
+        return;
+    }
+    if (type & TCG_MO_ST_LD) {
+        smp_mb();
+    } else if (type & TCG_MO_LD_LD) {
+        smp_rmb();
+    } else {
+        smp_wmb();
+    }
+#endif
+}
+
 #if defined(CONFIG_USER_ONLY)
 
 extern __thread uintptr_t helper_retaddr;
@@ -110,9 +137,6 @@ extern __thread uintptr_t helper_retaddr;
 
 #else
 
-/* The memory helpers for tcg-generated code need tcg_target_long etc.  */
-#include "tcg.h"
-
 #ifdef MMU_MODE0_SUFFIX
 #define CPU_MMU_INDEX 0
 #define MEMSUFFIX MMU_MODE0_SUFFIX
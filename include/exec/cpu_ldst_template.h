@@ -103,6 +103,9 @@ glue(glue(glue(cpu_ld, USUFFIX), MEMSUFFIX), _ra)(CPUArchState *env,
                                                             oi, retaddr);
     } else {
         uintptr_t hostaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+#if !defined(SOFTMMU_CODE_ACCESS)
+        cpu_req_mo(TCG_MO_LD_LD | TCG_MO_ST_LD);
+#endif
         res = glue(glue(ld, USUFFIX), _p)((uint8_t *)hostaddr);
     }
     return res;
@@ -141,6 +144,9 @@ glue(glue(glue(cpu_lds, SUFFIX), MEMSUFFIX), _ra)(CPUArchState *env,
                                MMUSUFFIX)(env, addr, oi, retaddr);
     } else {
         uintptr_t hostaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+#if !defined(SOFTMMU_CODE_ACCESS)
+        cpu_req_mo(TCG_MO_LD_LD | TCG_MO_ST_LD);
+#endif
         res = glue(glue(lds, SUFFIX), _p)((uint8_t *)hostaddr);
     }
     return res;
@@ -183,6 +189,7 @@ glue(glue(glue(cpu_st, SUFFIX), MEMSUFFIX), _ra)(CPUArchState *env,
                                                      retaddr);
     } else {
         uintptr_t hostaddr = addr + env->tlb_table[mmu_idx][page_index].addend;
+        cpu_req_mo(TCG_MO_LD_ST | TCG_MO_ST_ST);
         glue(glue(st, SUFFIX), _p)((uint8_t *)hostaddr, v);
     }
 }
@@ -68,6 +68,7 @@ glue(glue(cpu_ld, USUFFIX), MEMSUFFIX)(CPUArchState *env, target_ulong ptr)
     trace_guest_mem_before_exec(
         ENV_GET_CPU(env), ptr,
         trace_mem_build_info(SHIFT, false, MO_TE, false));
+    cpu_req_mo(TCG_MO_LD_LD | TCG_MO_ST_LD);
 #endif
     return glue(glue(ld, USUFFIX), _p)(g2h(ptr));
 }
@@ -92,6 +93,7 @@ glue(glue(cpu_lds, SUFFIX), MEMSUFFIX)(CPUArchState *env, target_ulong ptr)
     trace_guest_mem_before_exec(
         ENV_GET_CPU(env), ptr,
         trace_mem_build_info(SHIFT, true, MO_TE, false));
+    cpu_req_mo(TCG_MO_LD_LD | TCG_MO_ST_LD);
 #endif
     return glue(glue(lds, SUFFIX), _p)(g2h(ptr));
 }
@@ -118,6 +120,7 @@ glue(glue(cpu_st, SUFFIX), MEMSUFFIX)(CPUArchState *env, target_ulong ptr,
     trace_guest_mem_before_exec(
         ENV_GET_CPU(env), ptr,
         trace_mem_build_info(SHIFT, false, MO_TE, true));
+    cpu_req_mo(TCG_MO_LD_ST | TCG_MO_ST_ST);
 #endif
     glue(glue(st, SUFFIX), _p)(g2h(ptr), v);
 }
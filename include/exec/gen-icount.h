@@ -41,6 +41,10 @@ static inline void gen_tb_start(TranslationBlock *tb)
     }
 
     tcg_temp_free_i32(count);
+
+    if (tcg_ctx->tb_exec_count) {
+        tcg_gen_profile_count(tcg_ctx->tb_exec_count);
+    }
 }
 
 static inline void gen_tb_end(TranslationBlock *tb, int num_insns)
@@ -41,7 +41,17 @@ bool memory_region_access_valid(MemoryRegion *mr, hwaddr addr,
                                 MemTxAttrs attrs);
 
 void flatview_add_to_dispatch(FlatView *fv, MemoryRegionSection *section);
+void flatview_remove_from_dispatch(FlatView *fv, MemoryRegionSection *section);
 AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv);
+/* Copy the dispatch of the previous FlatView of the same root, with the
+ * sections of the @removed ranges dropped.  The caller then removes those
+ * ranges and adds the new ones.  Returns NULL if the dispatch should be
+ * built from scratch instead.
+ */
+AddressSpaceDispatch *address_space_dispatch_derive(FlatView *fv,
+                                                    AddressSpaceDispatch *old,
+                                                    MemoryRegionSection *removed,
+                                                    unsigned nr_removed);
 void address_space_dispatch_compact(AddressSpaceDispatch *d);
 void address_space_dispatch_free(AddressSpaceDispatch *d);
 
@@ -356,6 +356,7 @@ struct MemoryRegion {
 
     const MemoryRegionOps *ops;
     void *opaque;
+    QemuMutex *lock;
     MemoryRegion *container;
     Int128 size;
     hwaddr addr;
@@ -404,6 +405,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -1257,6 +1259,22 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size);
 
+/**
+ * memory_region_clear_dirty_bitmap: clear the accelerator's dirty log
+ *
+ * Accelerators such as KVM may leave the dirty log of a range set, and
+ * the range writable, after it has been synced into the dirty bitmap.
+ * Ask them to clear it and start tracking writes to the range again.
+ * This must be called after the range has been synced, but before its
+ * contents are read, or writes in between are lost.
+ *
+ * @mr: the memory region being cleared.
+ * @start: the address (relative to the start of the region) of the range.
+ * @len: length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty
  *                                         bitmap and clear it.
@@ -1417,6 +1435,22 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_global_locking(MemoryRegion *mr);
 
+/**
+ * memory_region_set_lock: Declares that accesses to the memory region are
+ *                         serialized by a device-provided lock instead of
+ *                         the QEMU global lock.
+ *
+ * Like memory_region_clear_global_locking(), but the memory API takes
+ * @lock around every call to the region's access handlers, so that the
+ * handlers only need to be safe against the device's own code paths that
+ * take @lock as well.  @lock may be taken with or without the global lock
+ * held, so handlers must never take the global lock themselves.
+ *
+ * @mr: the memory region to be updated.
+ * @lock: the lock protecting the device state used by the handlers.
+ */
+void memory_region_set_lock(MemoryRegion *mr, QemuMutex *lock);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
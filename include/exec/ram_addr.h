@@ -41,6 +41,11 @@ struct RAMBlock {
     size_t page_size;
     /* dirty bitmap used during migration */
     unsigned long *bmap;
+    /*
+     * bitmap of chunks whose dirty log was synced, but not yet cleared
+     * in the accelerator; one bit per 1 << RAM_CLEAR_BMAP_SHIFT pages
+     */
+    unsigned long *clear_bmap;
     /* bitmap of pages that haven't been sent even once
      * only maintained and used in postcopy at the moment
      * where it's used to send the dirtymap at the start
@@ -49,6 +54,13 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /*
+     * With mapped-ram, bitmap of the pages present in the file, and
+     * where the bitmap and the pages of this block live in the file
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -362,10 +374,25 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
 }
 #endif /* not _WIN32 */
 
+/*
+ * Merge the pages that TCG vCPUs logged as written into the
+ * DIRTY_MEMORY_MIGRATION and DIRTY_MEMORY_VGA bitmaps.  Must be
+ * called before reading those bitmaps.
+ */
+void cpu_physical_memory_dirty_log_flush(void);
+
 bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+/*
+ * Same as cpu_physical_memory_test_and_clear_dirty(), for callers that
+ * already called cpu_physical_memory_dirty_log_flush().
+ */
+bool cpu_physical_memory_test_and_clear_dirty_noflush(ram_addr_t start,
+                                                      ram_addr_t length,
+                                                      unsigned client);
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (ram_addr_t start, ram_addr_t length, unsigned client);
 
@@ -376,9 +403,13 @@ bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
 static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
                                                          ram_addr_t length)
 {
-    cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_MIGRATION);
-    cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_VGA);
-    cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_CODE);
+    cpu_physical_memory_dirty_log_flush();
+    cpu_physical_memory_test_and_clear_dirty_noflush(start, length,
+                                                     DIRTY_MEMORY_MIGRATION);
+    cpu_physical_memory_test_and_clear_dirty_noflush(start, length,
+                                                     DIRTY_MEMORY_VGA);
+    cpu_physical_memory_test_and_clear_dirty_noflush(start, length,
+                                                     DIRTY_MEMORY_CODE);
 }
 
 
@@ -393,6 +424,8 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     uint64_t num_dirty = 0;
     unsigned long *dest = rb->bmap;
 
+    cpu_physical_memory_dirty_log_flush();
+
     /* start address and length is aligned at the start of a word? */
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
          (start + rb->offset) &&
@@ -432,7 +465,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
         ram_addr_t offset = rb->offset;
 
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_test_and_clear_dirty(
+            if (cpu_physical_memory_test_and_clear_dirty_noflush(
                         start + addr + offset,
                         TARGET_PAGE_SIZE,
                         DIRTY_MEMORY_MIGRATION)) {
@@ -48,6 +48,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* Zero copy writes issued and completed, see qio_channel_flush() */
+    ssize_t zero_copy_queued;
+    ssize_t zero_copy_sent;
 };
 
 
@@ -257,4 +260,17 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
 
+/**
+ * qio_channel_socket_zero_copy_supported:
+ *
+ * Check whether connected TCP sockets can support the
+ * QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY feature: the host
+ * must be Linux, QEMU must have been built with MSG_ZEROCOPY
+ * and the running kernel must accept SO_ZEROCOPY.
+ *
+ * Returns: true if zero copy writes are supported
+ */
+bool qio_channel_socket_zero_copy_supported(void);
+
+
 #endif /* QIO_CHANNEL_SOCKET_H */
@@ -1048,6 +1048,12 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
                          void *opaque, QJSON *vmdesc, int version_id);
 
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque);
+/*
+ * Forget what was cached about @vmsd and the descriptions it refers to.
+ * Must be called, with the BQL held, before freeing a description that
+ * has been saved or loaded.
+ */
+void vmstate_drop_plan(const VMStateDescription *vmsd);
 
 /* Returns: 0 on success, -1 on failure */
 int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
@@ -0,0 +1,86 @@
+/*
+ * Atomic operations on 128-bit quantities.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_ATOMIC128_H
+#define QEMU_ATOMIC128_H
+
+#include "qemu/atomic.h"
+#include "qemu/int128.h"
+
+/* These are used by the TCG atomic helpers for 16-byte guest accesses.
+ *
+ * They are only available on hosts with a 16-byte compare-and-swap.
+ * Elsewhere the helpers must leave parallel mode with
+ * cpu_loop_exit_atomic() and redo the access under the exclusive step.
+ * A lock would only exclude other 16-byte operations, not plain or
+ * narrower stores from other vCPUs to the same bytes.
+ *
+ * HAVE_ATOMIC128 is defined when the functions are built, and
+ * atomic16_supported() tells whether the host CPU can run them.
+ */
+
+#ifdef CONFIG_ATOMIC128
+static inline Int128 atomic16_cmpxchg(Int128 *ptr, Int128 cmp, Int128 newv)
+{
+    return atomic_cmpxchg__nocheck(ptr, cmp, newv);
+}
+
+static inline Int128 atomic16_read(Int128 *ptr)
+{
+    Int128 val;
+
+    __atomic_load(ptr, &val, __ATOMIC_RELAXED);
+    return val;
+}
+
+static inline void atomic16_set(Int128 *ptr, Int128 val)
+{
+    __atomic_store(ptr, &val, __ATOMIC_RELAXED);
+}
+
+# define HAVE_ATOMIC128 1
+# define atomic16_supported() true
+#elif defined(__x86_64__) && defined(CONFIG_INT128) && defined(CONFIG_CPUID_H)
+/* Compilers only emit CMPXCHG16B with -mcx16, which the configure test
+ * does not use, although nearly every x86_64 host has it.  Issue it
+ * directly when CPUID says it is there.
+ */
+extern bool have_cmpxchg16b;
+
+static inline Int128 atomic16_cmpxchg(Int128 *ptr, Int128 cmp, Int128 newv)
+{
+    uint64_t lo = int128_getlo(cmp), hi = int128_gethi(cmp);
+
+    asm volatile("lock cmpxchg16b %2"
+                 : "+a"(lo), "+d"(hi), "+m"(*ptr)
+                 : "b"(int128_getlo(newv)), "c"(int128_gethi(newv))
+                 : "cc", "memory");
+    return int128_make128(lo, hi);
+}
+
+/* The comparison either fails or stores back the same value, so this
+ * reads atomically; the page must be writable, as for the other helpers.
+ */
+static inline Int128 atomic16_read(Int128 *ptr)
+{
+    return atomic16_cmpxchg(ptr, int128_zero(), int128_zero());
+}
+
+static inline void atomic16_set(Int128 *ptr, Int128 val)
+{
+    Int128 old = int128_zero(), cur;
+
+    while (!int128_eq(cur = atomic16_cmpxchg(ptr, old, val), old)) {
+        old = cur;
+    }
+}
+
+# define HAVE_ATOMIC128 1
+# define atomic16_supported() likely(have_cmpxchg16b)
+#endif
+
+#endif /* QEMU_ATOMIC128_H */
@@ -293,6 +293,15 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_contended: Return how many times the current thread
+ * had to wait for the main loop mutex.
+ *
+ * The count is per thread and only ever increases; callers can compare
+ * two samples to find out whether the lock was contended in between.
+ */
+uint64_t qemu_mutex_iothread_contended(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -157,6 +157,14 @@ extern int daemon(int, int);
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
+#ifndef MAP_FIXED_NOREPLACE
+#ifdef __linux__
+/* Older kernels ignore this flag and treat the address as a hint.  */
+#define MAP_FIXED_NOREPLACE 0x100000
+#else
+#define MAP_FIXED_NOREPLACE 0
+#endif
+#endif
 #ifndef ENOMEDIUM
 #define ENOMEDIUM ENODEV
 #endif
@@ -330,6 +338,14 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #else
 #define QEMU_MADV_REMOVE QEMU_MADV_INVALID
 #endif
+#ifdef MADV_POPULATE_WRITE
+#define QEMU_MADV_POPULATE_WRITE MADV_POPULATE_WRITE
+#elif defined(__linux__)
+/* Linux 5.14+; older kernels fail it with EINVAL */
+#define QEMU_MADV_POPULATE_WRITE 23
+#else
+#define QEMU_MADV_POPULATE_WRITE QEMU_MADV_INVALID
+#endif
 
 #elif defined(CONFIG_POSIX_MADVISE)
 
@@ -343,6 +359,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_HUGEPAGE  QEMU_MADV_INVALID
 #define QEMU_MADV_NOHUGEPAGE  QEMU_MADV_INVALID
 #define QEMU_MADV_REMOVE QEMU_MADV_INVALID
+#define QEMU_MADV_POPULATE_WRITE QEMU_MADV_INVALID
 
 #else /* no-op */
 
@@ -356,6 +373,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_HUGEPAGE  QEMU_MADV_INVALID
 #define QEMU_MADV_NOHUGEPAGE  QEMU_MADV_INVALID
 #define QEMU_MADV_REMOVE QEMU_MADV_INVALID
+#define QEMU_MADV_POPULATE_WRITE QEMU_MADV_INVALID
 
 #endif
 
@@ -536,9 +554,60 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz, int smp_cpus,
+/**
+ * os_mem_prealloc:
+ * @fd: file descriptor backing @area, or -1
+ * @area: start of the memory to preallocate
+ * @sz: size of the memory to preallocate
+ * @max_threads: upper bound on the number of threads to use, or 0 to
+ *               use one thread per usable host CPU
+ * @host_cpus: if not NULL, bitmap of the host CPUs that the preallocation
+ *             threads should run on, e.g. those local to the memory
+ * @nbits: number of bits in @host_cpus
+ * @errp: pointer to error object
+ *
+ * Touch every page of @area so that it is backed by host memory.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, int max_threads,
+                     const unsigned long *host_cpus, unsigned long nbits,
                      Error **errp);
 
+typedef struct MemPrealloc MemPrealloc;
+
+/**
+ * os_mem_prealloc_start:
+ *
+ * Same as os_mem_prealloc(), but if the host can populate memory without
+ * touching its contents (MADV_POPULATE_WRITE), return as soon as the
+ * preallocation threads are running.  Otherwise preallocate synchronously.
+ * The caller must not unmap @area before calling os_mem_prealloc_finish().
+ *
+ * Returns: a handle for os_mem_prealloc_progress() and
+ * os_mem_prealloc_finish(), or NULL on error.
+ */
+MemPrealloc *os_mem_prealloc_start(int fd, char *area, size_t sz,
+                                   int max_threads,
+                                   const unsigned long *host_cpus,
+                                   unsigned long nbits, Error **errp);
+
+/**
+ * os_mem_prealloc_progress:
+ * @p: the preallocation started with os_mem_prealloc_start()
+ *
+ * Returns: the number of bytes populated so far.  Can be called from
+ * any thread.
+ */
+size_t os_mem_prealloc_progress(MemPrealloc *p);
+
+/**
+ * os_mem_prealloc_finish:
+ * @p: the preallocation started with os_mem_prealloc_start()
+ * @errp: pointer to error object
+ *
+ * Wait for the preallocation to complete and free @p.
+ */
+void os_mem_prealloc_finish(MemPrealloc *p, Error **errp);
+
 /**
  * qemu_get_pid_name:
  * @pid: pid of a process
@@ -91,6 +91,13 @@ void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
+/*
+ * Restrict @thread to the host CPUs set in the @nbits long bitmap
+ * @host_cpus.  Returns 0 on success, a negative errno value otherwise.
+ */
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits);
 
 struct Notifier;
 void qemu_thread_atexit_add(struct Notifier *notifier);
@@ -27,6 +27,7 @@
 #include "qapi/qapi-types-run-state.h"
 #include "qemu/bitmap.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 
 typedef int (*WriteCoreDumpFunction)(const void *buf, size_t size,
@@ -244,6 +245,9 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
+struct KVMExitStats;
+struct CPUDirtyLog;
 
 struct hax_vcpu_state;
 
@@ -273,6 +277,7 @@ typedef void (*run_on_cpu_func)(CPUState *cpu, run_on_cpu_data data);
 struct qemu_work_item;
 
 #define CPU_UNSET_NUMA_NODE_ID -1
+#define TCG_DEFAULT_WEIGHT 100
 #define CPU_TRACE_DSTATE_MAX_EVENTS 32
 
 /**
@@ -292,6 +297,10 @@ struct qemu_work_item;
  * @crash_occurred: Indicates the OS reported a crash (panic) for this CPU
  * @singlestep_enabled: Flags for single-stepping.
  * @icount_extra: Instructions until next timer event.
+ * @exec_time_ns: Host time spent executing guest code under TCG.
+ * @exec_slices: Number of times TCG has scheduled this CPU.
+ * @tcg_weight: Length of the time slices of this CPU under round-robin
+ *   TCG, relative to TCG_DEFAULT_WEIGHT.
  * @icount_decr: Low 16 bits: number of cycles left, only used in icount mode.
  * High 16 bits: Set to -1 to force TCG to stop executing linked TBs for this
  * CPU and return to its top level loop (even in non-icount mode).
@@ -313,7 +322,14 @@ struct qemu_work_item;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
+ * @dirty_pages: Number of guest page writes attributed to this vCPU by
+ *   dirty tracking (KVM dirty rings or the TCG dirty log).
+ * @dirty_log: Pages written by this vCPU through the TCG notdirty path that
+ *   have not been merged into the global dirty bitmaps yet.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Dirty ring of this vCPU when KVM dirty rings are in use.
+ * @kvm_fetch_index: Next entry of @kvm_dirty_gfns to harvest.
+ * @kvm_exit_stats: Statistics about the KVM exits handled by this vCPU.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -353,6 +369,9 @@ struct CPUState {
     int singlestep_enabled;
     int64_t icount_budget;
     int64_t icount_extra;
+    Stat64 exec_time_ns;
+    Stat64 exec_slices;
+    uint32_t tcg_weight;
     sigjmp_buf jmp_env;
 
     QemuMutex work_mutex;
@@ -386,10 +405,15 @@ struct CPUState {
      */
     uintptr_t mem_io_pc;
     vaddr mem_io_vaddr;
+    Stat64 dirty_pages;
+    struct CPUDirtyLog *dirty_log;
 
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    struct KVMExitStats *kvm_exit_stats;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -408,6 +432,8 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu alone, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
 
     bool ignore_memory_transaction_failures;
 
@@ -815,10 +841,22 @@ CPUState *cpu_by_arch_id(int64_t id);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 0 to 99.
+ *
+ * Like cpu_throttle_set, but only affects @cpu.  The vcpu sleeps for the
+ * larger of @new_throttle_pct and the percentage set by cpu_throttle_set;
+ * a percentage of 0 removes the throttling specific to @cpu.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set and
+ * cpu_throttle_set_vcpu.
  */
 void cpu_throttle_stop(void);
 
@@ -833,6 +871,7 @@ bool cpu_throttle_active(void);
  * cpu_throttle_get_percentage:
  *
  * Returns the vcpu throttle percentage. See cpu_throttle_set for details.
+ * If vcpus are throttled individually, the highest percentage is returned.
  *
  * Returns: The throttle percentage in range 1 to 99.
  */
@@ -55,9 +55,13 @@ struct HostMemoryBackend {
     uint64_t size;
     bool merge, dump;
     bool prealloc, force_prealloc, is_mapped, share;
+    uint32_t prealloc_threads;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
 
+    /* private */
+    MemPrealloc *prealloc_job;
+
     MemoryRegion mr;
 };
 
@@ -68,4 +72,36 @@ void host_memory_backend_set_mapped(HostMemoryBackend *backend, bool mapped);
 bool host_memory_backend_is_mapped(HostMemoryBackend *backend);
 size_t host_memory_backend_pagesize(HostMemoryBackend *memdev);
 
+/**
+ * host_memory_backend_get_host_cpus:
+ * @backend: the memory backend
+ * @nbits: set to the number of bits in the returned bitmap
+ *
+ * Returns: a bitmap of the host CPUs that belong to the host NUMA nodes
+ * the backend is bound to (only the first one for the "preferred"
+ * policy), to be freed with g_free(); or NULL if the backend is not
+ * bound to specific host nodes.
+ */
+unsigned long *host_memory_backend_get_host_cpus(HostMemoryBackend *backend,
+                                                 unsigned long *nbits);
+
+/**
+ * host_memory_backend_prealloc_populated:
+ * @backend: the memory backend
+ *
+ * Returns: the number of bytes of @backend preallocated so far, which is
+ * less than its size while preallocation still runs in the background.
+ */
+uint64_t host_memory_backend_prealloc_populated(HostMemoryBackend *backend);
+
+/**
+ * host_memory_backend_prealloc_wait:
+ *
+ * Wait for the background preallocation of all memory backends created
+ * at startup to complete.  Must be called before anything, board, device
+ * or incoming migration, writes to guest RAM.  Exits QEMU if
+ * preallocation failed.
+ */
+void host_memory_backend_prealloc_wait(void);
+
 #endif
@@ -32,6 +32,8 @@ typedef struct {
     bool stopping;              /* has iothread_stop() been called? */
     bool running;               /* should iothread_run() continue? */
     int thread_id;
+    /* Guest NUMA node whose host nodes the thread runs on, or -1 */
+    int64_t numa_node;
 
     /* AioContext poll parameters */
     int64_t poll_max_ns;
@@ -18,6 +18,8 @@
 #include "block/aio.h"
 #include "block/block.h"
 #include "sysemu/iothread.h"
+#include "sysemu/numa.h"
+#include "sysemu/sysemu.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qemu/error-report.h"
@@ -110,6 +112,7 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->numa_node = -1;
 }
 
 static void iothread_instance_finalize(Object *obj)
@@ -180,6 +183,11 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     g_free(thread_name);
     g_free(name);
 
+    /* Before that, the NUMA configuration is not known yet */
+    if (machine_init_done) {
+        numa_iothread_set_affinity(iothread);
+    }
+
     /* Wait for initialization to complete */
     qemu_mutex_lock(&iothread->init_done_lock);
     while (iothread->thread_id == -1) {
@@ -248,6 +256,38 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void iothread_get_numa_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, name, &iothread->numa_node, errp);
+}
+
+static void iothread_set_numa_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < -1 || value >= MAX_NODES) {
+        error_setg(&local_err, "numa-node must be in range [-1, %d]",
+                   MAX_NODES - 1);
+        goto out;
+    }
+
+    iothread->numa_node = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -265,6 +305,10 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "numa-node", "int",
+                              iothread_get_numa_node,
+                              iothread_set_numa_node,
+                              NULL, NULL, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -1924,12 +1924,41 @@ static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
     return sp;
 }
 
+/* Return the end of the lowest host mapping that overlaps
+ * [start, start + size), or 0 if there is none or it cannot be told.
+ */
+static unsigned long guest_space_busy_end(unsigned long start,
+                                          unsigned long size)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t len = 0;
+    unsigned long min, max, end = 0;
+
+    fp = fopen("/proc/self/maps", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (getline(&line, &len, fp) != -1) {
+        if (sscanf(line, "%lx-%lx", &min, &max) != 2) {
+            continue;
+        }
+        if (min - start < size || start - min < max - min) {
+            end = max;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return end;
+}
+
 unsigned long init_guest_space(unsigned long host_start,
                                unsigned long host_size,
                                unsigned long guest_start,
                                bool fixed)
 {
-    unsigned long current_start, aligned_start;
+    unsigned long current_start, aligned_start, skip_to;
     int flags;
 
     assert(host_start || host_size);
@@ -1950,6 +1979,14 @@ unsigned long init_guest_space(unsigned long host_start,
     flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
     if (fixed) {
         flags |= MAP_FIXED;
+    } else if (host_start) {
+        /* Have the kernel fail instead of placing the reservation
+         * somewhere else when the range is busy.  That way a probe
+         * costs a single syscall rather than an mmap/munmap pair.
+         * Kernels that predate the flag treat the address as a hint,
+         * which the check below still catches.
+         */
+        flags |= MAP_FIXED_NOREPLACE;
     }
 
     /* Otherwise, a non-zero size region of memory needs to be mapped
@@ -2013,6 +2050,20 @@ unsigned long init_guest_space(unsigned long host_start,
          */
         real_start = (unsigned long)
             mmap((void *)current_start, host_size, PROT_NONE, flags, -1, 0);
+        if (real_start == (unsigned long)-1 && (flags & MAP_FIXED_NOREPLACE)) {
+            if (errno == EEXIST) {
+                /* Skip the whole busy mapping rather than a page */
+                skip_to = guest_space_busy_end(current_start, host_size);
+                goto skip;
+            }
+            /* ENOMEM or EINVAL, e.g. the range runs past the top of the
+             * address space.  Probe with a plain hint as before the flag
+             * was used, and let the check below reject a moved mapping.
+             */
+            real_start = (unsigned long)
+                mmap((void *)current_start, host_size, PROT_NONE,
+                     flags & ~MAP_FIXED_NOREPLACE, -1, 0);
+        }
         if (real_start == (unsigned long)-1) {
             return (unsigned long)-1;
         }
@@ -2088,13 +2139,21 @@ unsigned long init_guest_space(unsigned long host_start,
          * because of trouble with ARM commpage setup.
          */
         munmap((void *)real_start, real_size);
-        current_start += qemu_host_page_size;
-        if (host_start == current_start) {
-            /* Theoretically possible if host doesn't have any suitably
-             * aligned areas.  Normally the first mmap will fail.
+        skip_to = 0;
+    skip:
+        if (skip_to <= current_start) {
+            skip_to = current_start + qemu_host_page_size;
+        } else {
+            skip_to = HOST_PAGE_ALIGN(skip_to);
+        }
+        if (skip_to - host_start <= current_start - host_start) {
+            /* Wrapped around to host_start.  Theoretically possible if
+             * host doesn't have any suitably aligned areas.  Normally
+             * the first mmap will fail.
              */
             return (unsigned long)-1;
         }
+        current_start = skip_to;
     }
 
     qemu_log_mask(CPU_LOG_PAGE, "Reserved 0x%lx bytes of guest address space\n", host_size);
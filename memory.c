@@ -244,6 +244,22 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static FlatView *flatview_new(MemoryRegion *mr_root)
 {
     FlatView *view;
@@ -584,6 +600,9 @@ static MemTxResult access_with_adjusted_size(hwaddr addr,
     /* FIXME: support unaligned access? */
     access_size = MAX(MIN(size, access_size_max), access_size_min);
     access_mask = -1ULL >> (64 - access_size * 8);
+    if (mr->lock) {
+        qemu_mutex_lock(mr->lock);
+    }
     if (memory_region_big_endian(mr)) {
         for (i = 0; i < size; i += access_size) {
             r |= access_fn(mr, addr + i, value, access_size,
@@ -595,6 +614,9 @@ static MemTxResult access_with_adjusted_size(hwaddr addr,
                         access_mask, attrs);
         }
     }
+    if (mr->lock) {
+        qemu_mutex_unlock(mr->lock);
+    }
     return r;
 }
 
@@ -744,8 +766,65 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+/* Build the dispatch tree of @view from the one of @old_view, only
+ * removing and adding the ranges that differ.  Returns false if the
+ * tree has to be built from scratch.
+ */
+static bool flatview_derive_dispatch(FlatView *view, FlatView *old_view)
+{
+    MemoryRegionSection *removed, mrs;
+    unsigned *added;
+    unsigned iold = 0, inew = 0, nr_removed = 0, nr_added = 0, i;
+
+    removed = g_new(MemoryRegionSection, old_view->nr);
+    added = g_new(unsigned, view->nr);
+
+    /* Same walk as address_space_update_topology_pass() */
+    while (iold < old_view->nr || inew < view->nr) {
+        FlatRange *frold = iold < old_view->nr ? &old_view->ranges[iold] : NULL;
+        FlatRange *frnew = inew < view->nr ? &view->ranges[inew] : NULL;
+
+        if (frold
+            && (!frnew
+                || int128_lt(frold->addr.start, frnew->addr.start)
+                || (int128_eq(frold->addr.start, frnew->addr.start)
+                    && !flatrange_equal(frold, frnew)))) {
+            removed[nr_removed++] = section_from_flat_range(frold, view);
+            ++iold;
+        } else if (frold && frnew && flatrange_equal(frold, frnew)) {
+            ++iold;
+            ++inew;
+        } else {
+            added[nr_added++] = inew;
+            ++inew;
+        }
+    }
+
+    view->dispatch = address_space_dispatch_derive(view, old_view->dispatch,
+                                                   removed, nr_removed);
+    if (view->dispatch) {
+        for (i = 0; i < nr_removed; i++) {
+            flatview_remove_from_dispatch(view, &removed[i]);
+        }
+        for (i = 0; i < nr_added; i++) {
+            mrs = section_from_flat_range(&view->ranges[added[i]], view);
+            flatview_add_to_dispatch(view, &mrs);
+        }
+    }
+
+    g_free(removed);
+    g_free(added);
+    return view->dispatch != NULL;
+}
+
+/* Render a memory topology into a list of disjoint absolute ranges.
+ * If it comes out the same as @old_view, return @old_view instead so
+ * that its dispatch tree is kept and listeners are not replayed.
+ * Otherwise only the ranges that changed since @old_view are applied
+ * to the dispatch tree.
+ */
+static FlatView *generate_memory_topology(MemoryRegion *mr,
+                                          FlatView *old_view)
 {
     int i;
     FlatView *view;
@@ -758,11 +837,20 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
+    if (old_view && flatview_equal(old_view, view)) {
+        flatview_unref(view);
+        flatview_ref(old_view);
+        g_hash_table_replace(flat_views, mr, old_view);
+        return old_view;
+    }
+
+    if (!old_view || !flatview_derive_dispatch(view, old_view)) {
+        view->dispatch = address_space_dispatch_new(view);
+        for (i = 0; i < view->nr; i++) {
+            MemoryRegionSection mrs =
+                section_from_flat_range(&view->ranges[i], view);
+            flatview_add_to_dispatch(view, &mrs);
+        }
     }
     address_space_dispatch_compact(view->dispatch);
     g_hash_table_replace(flat_views, mr, view);
@@ -946,7 +1034,7 @@ static void flatviews_init(void)
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
     if (!empty_view) {
-        empty_view = generate_memory_topology(NULL);
+        empty_view = generate_memory_topology(NULL, NULL);
         /* We keep it alive forever in the global variable.  */
         flatview_ref(empty_view);
     } else {
@@ -958,26 +1046,33 @@ static void flatviews_init(void)
 static void flatviews_reset(void)
 {
     AddressSpace *as;
+    GHashTable *old_flat_views = flat_views;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, reusing the ones that did not change */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view = NULL;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        if (old_flat_views) {
+            old_view = g_hash_table_lookup(old_flat_views, physmr);
+        }
+        generate_memory_topology(physmr, old_view);
+    }
+
+    if (old_flat_views) {
+        g_hash_table_unref(old_flat_views);
     }
 }
 
-static void address_space_set_flatview(AddressSpace *as)
+/* Returns true if the address space switched to a different FlatView.  */
+static bool address_space_set_flatview(AddressSpace *as)
 {
     FlatView *old_view = address_space_to_flatview(as);
     MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
@@ -986,7 +1081,15 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
-        return;
+        FlatRange *fr;
+
+        /* Nothing was added or removed, but listeners that rebuild
+         * their state on every commit still expect to see each range.
+         */
+        FOR_EACH_FLAT_RANGE(fr, new_view) {
+            MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, region_nop);
+        }
+        return false;
     }
 
     if (old_view) {
@@ -1020,6 +1123,7 @@ static void address_space_set_flatview(AddressSpace *as)
     if (old_view) {
         flatview_unref(old_view);
     }
+    return true;
 }
 
 static void address_space_update_topology(AddressSpace *as)
@@ -1028,7 +1132,7 @@ static void address_space_update_topology(AddressSpace *as)
 
     flatviews_init();
     if (!g_hash_table_lookup(flat_views, physmr)) {
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, NULL);
     }
     address_space_set_flatview(as);
 }
@@ -1054,8 +1158,9 @@ void memory_region_transaction_commit(void)
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (address_space_set_flatview(as) || ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
@@ -1966,6 +2071,9 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size, unsigned client)
 {
     assert(mr->ram_block);
+    if (client != DIRTY_MEMORY_CODE) {
+        cpu_physical_memory_dirty_log_flush();
+    }
     return cpu_physical_memory_get_dirty(memory_region_get_ram_addr(mr) + addr,
                                          size, client);
 }
@@ -2007,6 +2115,45 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (!listener->log_clear) {
+            continue;
+        }
+        as = listener->address_space;
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegionSection mrs;
+            hwaddr sec_start, sec_end;
+
+            if (!fr->dirty_log_mask || fr->mr != mr) {
+                continue;
+            }
+            mrs = section_from_flat_range(fr, view);
+            sec_start = MAX(mrs.offset_within_region, start);
+            sec_end = MIN(mrs.offset_within_region + int128_get64(mrs.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+            /* Narrow the section down to the range being cleared */
+            mrs.offset_within_address_space += sec_start -
+                                               mrs.offset_within_region;
+            mrs.offset_within_region = sec_start;
+            mrs.size = int128_make64(sec_end - sec_start);
+            listener->log_clear(listener, &mrs);
+        }
+        flatview_unref(view);
+    }
+}
+
 DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
                                                             hwaddr addr,
                                                             hwaddr size,
@@ -2014,6 +2161,7 @@ DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
 {
     assert(mr->ram_block);
     memory_region_sync_dirty_bitmap(mr);
+    memory_region_clear_dirty_bitmap(mr, addr, size);
     return cpu_physical_memory_snapshot_and_clear_dirty(
                 memory_region_get_ram_addr(mr) + addr, size, client);
 }
@@ -2211,6 +2359,12 @@ void memory_region_clear_global_locking(MemoryRegion *mr)
     mr->global_locking = false;
 }
 
+void memory_region_set_lock(MemoryRegion *mr, QemuMutex *lock)
+{
+    mr->lock = lock;
+    mr->global_locking = false;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
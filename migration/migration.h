@@ -26,6 +26,18 @@ struct PostcopyBlocktimeContext;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
+/* Channels that carry RAM pages to the destination */
+enum {
+    /* The main migration stream */
+    RAM_CHANNEL_PRECOPY = 0,
+    /* Pages requested during postcopy, with postcopy-preempt */
+    RAM_CHANNEL_POSTCOPY,
+    RAM_CHANNEL_MAX,
+};
+
+/* Number of buckets of the postcopy fault latency histogram */
+#define POSTCOPY_FAULT_LATENCY_BUCKETS 21
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -55,7 +67,18 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /*
+     * Postcopy prefetch: block, offset and distance from the previous
+     * one of the last fault, the stride being prefetched and the first
+     * offset along it that has not been requested yet
+     */
+    RAMBlock *prefetch_rb;
+    ram_addr_t prefetch_offset;
+    int64_t prefetch_delta;
+    int64_t prefetch_stride;
+    ram_addr_t prefetch_next;
+    /* Host page being assembled, for each channel */
+    void     *postcopy_tmp_page[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
@@ -80,6 +103,20 @@ struct MigrationIncomingState {
     bool postcopy_recover_triggered;
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
+
+    /* Postcopy preempt channel and the thread loading from it */
+    QEMUFile *postcopy_qemufile_dst;
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool have_preempt_thread;
+    QemuThread preempt_thread;
+
+    /*
+     * Faulted host pages that have not arrived yet, mapped to the time
+     * of the fault, and the histogram of the fault latencies.
+     */
+    QemuMutex fault_latency_mutex;
+    GHashTable *fault_latency_pending;
+    uint64_t fault_latency[POSTCOPY_FAULT_LATENCY_BUCKETS];
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -214,6 +251,11 @@ struct MigrationState
     /* Whether we send section footer during migration */
     bool send_section_footer;
 
+    /* Postcopy preempt channel, for the pages the destination requests */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the preempt channel connected, or failed to */
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
@@ -256,12 +298,15 @@ bool migrate_dirty_bitmaps(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_use_zero_copy_send(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 int migrate_multifd_page_count(void);
+MultiFDCompression migrate_multifd_compression(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+uint32_t migrate_postcopy_prefetch_pages(void);
 bool migrate_colo_enabled(void);
 
 bool migrate_use_block(void);
@@ -274,6 +319,10 @@ int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_background_snapshot(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_postcopy_prefetch(void);
+bool migrate_mapped_ram(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -282,6 +331,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, const char* rbname,
                               ram_addr_t start, size_t len);
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                   ram_addr_t start, size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
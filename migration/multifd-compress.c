@@ -0,0 +1,422 @@
+/*
+ * Multifd compression methods
+ *
+ * Each method compresses the normal pages of a packet into one buffer on
+ * the send side, and decompresses it into the pages on the receive side.
+ * Send and receive state is per channel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "multifd-compress.h"
+
+/* Multifd zlib compression */
+
+typedef struct {
+    z_stream zs;
+    uint8_t *zbuff;
+    uint32_t zbuff_len;
+    /* copy of the page being compressed */
+    uint8_t *page;
+    uint32_t page_size;
+} MultiFDZlibData;
+
+static void *zlib_send_setup(uint32_t page_count, uint32_t page_size,
+                             int level, Error **errp)
+{
+    MultiFDZlibData *z = g_new0(MultiFDZlibData, 1);
+
+    if (deflateInit(&z->zs, level) != Z_OK) {
+        error_setg(errp, "multifd: zlib deflate init failed");
+        g_free(z);
+        return NULL;
+    }
+    z->zbuff_len = MULTIFD_COMPRESS_MAX(page_count, page_size);
+    z->zbuff = g_malloc(z->zbuff_len);
+    z->page = g_malloc(page_size);
+    z->page_size = page_size;
+    return z;
+}
+
+static void zlib_send_cleanup(void *opaque)
+{
+    MultiFDZlibData *z = opaque;
+
+    deflateEnd(&z->zs);
+    g_free(z->zbuff);
+    g_free(z->page);
+    g_free(z);
+}
+
+static int zlib_send_prepare(void *opaque, struct iovec *iov, uint32_t num,
+                             uint8_t **buf, uint32_t *len, Error **errp)
+{
+    MultiFDZlibData *z = opaque;
+    z_stream *zs = &z->zs;
+    uint32_t i;
+    int ret;
+
+    zs->next_out = z->zbuff;
+    zs->avail_out = z->zbuff_len;
+    for (i = 0; i < num; i++) {
+        /* The stream is flushed at the end of each packet */
+        int flush = i == num - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        /*
+         * The guest may write the page while deflate() reads it, possibly
+         * more than once; compress a stable copy so that the stream is
+         * always consistent.  A page that changed is sent again later.
+         */
+        assert(iov[i].iov_len <= z->page_size);
+        memcpy(z->page, iov[i].iov_base, iov[i].iov_len);
+        zs->next_in = z->page;
+        zs->avail_in = iov[i].iov_len;
+        do {
+            ret = deflate(zs, flush);
+        } while (ret == Z_OK && zs->avail_in && zs->avail_out);
+
+        if (ret != Z_OK || zs->avail_in || !zs->avail_out) {
+            error_setg(errp, "multifd: zlib deflate failed (%d)", ret);
+            return -1;
+        }
+    }
+    *buf = z->zbuff;
+    *len = z->zbuff_len - zs->avail_out;
+    return 0;
+}
+
+static void *zlib_recv_setup(Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (inflateInit(zs) != Z_OK) {
+        error_setg(errp, "multifd: zlib inflate init failed");
+        g_free(zs);
+        return NULL;
+    }
+    return zs;
+}
+
+static void zlib_recv_cleanup(void *opaque)
+{
+    z_stream *zs = opaque;
+
+    inflateEnd(zs);
+    g_free(zs);
+}
+
+static int zlib_recv_pages(void *opaque, uint8_t *buf, uint32_t len,
+                           struct iovec *iov, uint32_t num, Error **errp)
+{
+    z_stream *zs = opaque;
+    uint32_t i;
+    int ret = Z_OK;
+
+    zs->next_in = buf;
+    zs->avail_in = len;
+    for (i = 0; i < num; i++) {
+        zs->next_out = iov[i].iov_base;
+        zs->avail_out = iov[i].iov_len;
+        do {
+            ret = inflate(zs, Z_SYNC_FLUSH);
+        } while (ret == Z_OK && zs->avail_in && zs->avail_out);
+
+        if (ret != Z_OK || zs->avail_out) {
+            error_setg(errp, "multifd: zlib inflate failed (%d)", ret);
+            return -1;
+        }
+    }
+    /* Consume the flush marker that ends the data of the packet */
+    if (zs->avail_in) {
+        ret = inflate(zs, Z_SYNC_FLUSH);
+    }
+    if (zs->avail_in) {
+        error_setg(errp, "multifd: zlib inflate left %u bytes (%d)",
+                   zs->avail_in, ret);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDMethods multifd_zlib_methods = {
+    .send_setup = zlib_send_setup,
+    .send_cleanup = zlib_send_cleanup,
+    .send_prepare = zlib_send_prepare,
+    .recv_setup = zlib_recv_setup,
+    .recv_cleanup = zlib_recv_cleanup,
+    .recv_pages = zlib_recv_pages,
+};
+
+#ifdef CONFIG_ZSTD
+/* Multifd zstd compression */
+
+typedef struct {
+    ZSTD_CStream *zcs;
+    uint8_t *zbuff;
+    uint32_t zbuff_len;
+} MultiFDZstdData;
+
+static void zstd_send_cleanup(void *opaque)
+{
+    MultiFDZstdData *z = opaque;
+
+    ZSTD_freeCStream(z->zcs);
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+static void *zstd_send_setup(uint32_t page_count, uint32_t page_size,
+                             int level, Error **errp)
+{
+    MultiFDZstdData *z = g_new0(MultiFDZstdData, 1);
+    size_t ret;
+
+    z->zcs = ZSTD_createCStream();
+    if (!z->zcs) {
+        error_setg(errp, "multifd: zstd stream allocation failed");
+        g_free(z);
+        return NULL;
+    }
+    ret = ZSTD_initCStream(z->zcs, level);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd: zstd init failed: %s",
+                   ZSTD_getErrorName(ret));
+        zstd_send_cleanup(z);
+        return NULL;
+    }
+    z->zbuff_len = MULTIFD_COMPRESS_MAX(page_count, page_size);
+    z->zbuff = g_malloc(z->zbuff_len);
+    return z;
+}
+
+static int zstd_send_prepare(void *opaque, struct iovec *iov, uint32_t num,
+                             uint8_t **buf, uint32_t *len, Error **errp)
+{
+    MultiFDZstdData *z = opaque;
+    ZSTD_outBuffer out = { z->zbuff, z->zbuff_len, 0 };
+    uint32_t i;
+    size_t ret;
+
+    for (i = 0; i < num; i++) {
+        ZSTD_inBuffer in = { iov[i].iov_base, iov[i].iov_len, 0 };
+
+        do {
+            ret = ZSTD_compressStream(z->zcs, &out, &in);
+        } while (!ZSTD_isError(ret) && in.pos < in.size && out.pos < out.size);
+
+        if (ZSTD_isError(ret) || in.pos < in.size) {
+            error_setg(errp, "multifd: zstd compression failed: %s",
+                       ZSTD_isError(ret) ? ZSTD_getErrorName(ret)
+                                         : "buffer full");
+            return -1;
+        }
+    }
+    /* The stream is flushed at the end of each packet */
+    ret = ZSTD_flushStream(z->zcs, &out);
+    if (ret != 0) {
+        error_setg(errp, "multifd: zstd flush failed: %s",
+                   ZSTD_isError(ret) ? ZSTD_getErrorName(ret)
+                                     : "buffer full");
+        return -1;
+    }
+    *buf = z->zbuff;
+    *len = out.pos;
+    return 0;
+}
+
+static void zstd_recv_cleanup(void *opaque)
+{
+    ZSTD_freeDStream(opaque);
+}
+
+static void *zstd_recv_setup(Error **errp)
+{
+    ZSTD_DStream *zds = ZSTD_createDStream();
+    size_t ret;
+
+    if (!zds) {
+        error_setg(errp, "multifd: zstd stream allocation failed");
+        return NULL;
+    }
+    ret = ZSTD_initDStream(zds);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd: zstd init failed: %s",
+                   ZSTD_getErrorName(ret));
+        ZSTD_freeDStream(zds);
+        return NULL;
+    }
+    return zds;
+}
+
+static int zstd_recv_pages(void *opaque, uint8_t *buf, uint32_t len,
+                           struct iovec *iov, uint32_t num, Error **errp)
+{
+    ZSTD_DStream *zds = opaque;
+    ZSTD_inBuffer in = { buf, len, 0 };
+    uint32_t i;
+
+    for (i = 0; i < num; i++) {
+        ZSTD_outBuffer out = { iov[i].iov_base, iov[i].iov_len, 0 };
+
+        while (out.pos < out.size) {
+            size_t in_pos = in.pos, out_pos = out.pos;
+            size_t ret = ZSTD_decompressStream(zds, &out, &in);
+
+            if (ZSTD_isError(ret)) {
+                error_setg(errp, "multifd: zstd decompression failed: %s",
+                           ZSTD_getErrorName(ret));
+                return -1;
+            }
+            if (in.pos == in_pos && out.pos == out_pos) {
+                error_setg(errp, "multifd: zstd data too short");
+                return -1;
+            }
+        }
+    }
+    if (in.pos != in.size) {
+        error_setg(errp, "multifd: zstd left %zu bytes", in.size - in.pos);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDMethods multifd_zstd_methods = {
+    .send_setup = zstd_send_setup,
+    .send_cleanup = zstd_send_cleanup,
+    .send_prepare = zstd_send_prepare,
+    .recv_setup = zstd_recv_setup,
+    .recv_cleanup = zstd_recv_cleanup,
+    .recv_pages = zstd_recv_pages,
+};
+#endif
+
+#ifdef CONFIG_LZ4
+/*
+ * Multifd LZ4 compression
+ *
+ * Guest memory can change under the compressor, so pages are compressed
+ * as independent blocks instead of a stream that would reference them
+ * later.  The data starts with the big endian size of each block.
+ */
+
+typedef struct {
+    uint8_t *zbuff;
+    uint32_t zbuff_len;
+} MultiFDLz4Data;
+
+static void *lz4_send_setup(uint32_t page_count, uint32_t page_size,
+                            int level, Error **errp)
+{
+    MultiFDLz4Data *z = g_new0(MultiFDLz4Data, 1);
+
+    z->zbuff_len = page_count * (sizeof(uint32_t) +
+                                 LZ4_compressBound(page_size));
+    z->zbuff = g_malloc(z->zbuff_len);
+    return z;
+}
+
+static void lz4_send_cleanup(void *opaque)
+{
+    MultiFDLz4Data *z = opaque;
+
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+static int lz4_send_prepare(void *opaque, struct iovec *iov, uint32_t num,
+                            uint8_t **buf, uint32_t *len, Error **errp)
+{
+    MultiFDLz4Data *z = opaque;
+    uint32_t pos = num * sizeof(uint32_t);
+    uint32_t i;
+
+    for (i = 0; i < num; i++) {
+        int ret = LZ4_compress_default(iov[i].iov_base,
+                                       (char *)z->zbuff + pos,
+                                       iov[i].iov_len, z->zbuff_len - pos);
+
+        if (ret <= 0) {
+            error_setg(errp, "multifd: lz4 compression failed (%d)", ret);
+            return -1;
+        }
+        stl_be_p(z->zbuff + i * sizeof(uint32_t), ret);
+        pos += ret;
+    }
+    *buf = z->zbuff;
+    *len = pos;
+    return 0;
+}
+
+static int lz4_recv_pages(void *opaque, uint8_t *buf, uint32_t len,
+                          struct iovec *iov, uint32_t num, Error **errp)
+{
+    uint32_t pos = num * sizeof(uint32_t);
+    uint32_t i;
+
+    if (len < pos) {
+        error_setg(errp, "multifd: lz4 data too short");
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        uint32_t size = ldl_be_p(buf + i * sizeof(uint32_t));
+        int ret;
+
+        if (size > len - pos) {
+            error_setg(errp, "multifd: lz4 block %u too long", i);
+            return -1;
+        }
+        ret = LZ4_decompress_safe((char *)buf + pos, iov[i].iov_base,
+                                  size, iov[i].iov_len);
+        if (ret != iov[i].iov_len) {
+            error_setg(errp, "multifd: lz4 decompression failed (%d)", ret);
+            return -1;
+        }
+        pos += size;
+    }
+    if (pos != len) {
+        error_setg(errp, "multifd: lz4 left %u bytes", len - pos);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDMethods multifd_lz4_methods = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_pages = lz4_recv_pages,
+};
+#endif
+
+/* Compression methods built in, MULTIFD_COMPRESSION_NONE has none */
+static const MultiFDMethods *multifd_methods[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_ZLIB] = &multifd_zlib_methods,
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = &multifd_zstd_methods,
+#endif
+#ifdef CONFIG_LZ4
+    [MULTIFD_COMPRESSION_LZ4] = &multifd_lz4_methods,
+#endif
+};
+
+const MultiFDMethods *multifd_compress_methods(MultiFDCompression method)
+{
+    return method < MULTIFD_COMPRESSION__MAX ? multifd_methods[method] : NULL;
+}
+
+bool multifd_compression_supported(MultiFDCompression method)
+{
+    return method < MULTIFD_COMPRESSION__MAX &&
+           (method == MULTIFD_COMPRESSION_NONE || multifd_methods[method]);
+}
@@ -0,0 +1,43 @@
+/*
+ * Multifd compression methods
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MULTIFD_COMPRESS_H
+#define QEMU_MIGRATION_MULTIFD_COMPRESS_H
+
+#include "qapi/qapi-types-migration.h"
+
+/* Upper bound of the data that follows a packet of @pages normal pages */
+#define MULTIFD_COMPRESS_MAX(pages, page_size) \
+    ((pages) * (page_size) * 2 + 4096)
+
+typedef struct {
+    /*
+     * Allocate the compression state of a send channel, for packets of at
+     * most @page_count pages of @page_size bytes
+     */
+    void *(*send_setup)(uint32_t page_count, uint32_t page_size, int level,
+                        Error **errp);
+    void (*send_cleanup)(void *opaque);
+    /*
+     * Compress the @num pages of @iov.  On success, return 0 and point
+     * @buf and @len at the data to send, which lives until the next call.
+     */
+    int (*send_prepare)(void *opaque, struct iovec *iov, uint32_t num,
+                        uint8_t **buf, uint32_t *len, Error **errp);
+    /* Allocate the decompression state of a receive channel, optional */
+    void *(*recv_setup)(Error **errp);
+    void (*recv_cleanup)(void *opaque);
+    /* Decompress @len bytes at @buf into the @num pages of @iov */
+    int (*recv_pages)(void *opaque, uint8_t *buf, uint32_t len,
+                      struct iovec *iov, uint32_t num, Error **errp);
+} MultiFDMethods;
+
+/* The methods of @method, NULL for none or if it is not built in */
+const MultiFDMethods *multifd_compress_methods(MultiFDCompression method);
+bool multifd_compression_supported(MultiFDCompression method);
+
+#endif
@@ -17,6 +17,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -28,6 +29,9 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -166,6 +170,23 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    if (postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        uint64List *list = NULL, *entry;
+        int i;
+
+        qemu_mutex_lock(&mis->fault_latency_mutex);
+        for (i = POSTCOPY_FAULT_LATENCY_BUCKETS - 1; i >= 0; i--) {
+            entry = g_new0(uint64List, 1);
+            entry->value = mis->fault_latency[i];
+            entry->next = list;
+            list = entry;
+        }
+        qemu_mutex_unlock(&mis->fault_latency_mutex);
+
+        info->has_postcopy_fault_latency = true;
+        info->postcopy_fault_latency = list;
+    }
+
     if (!bc) {
         return;
     }
@@ -514,8 +535,24 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * On success the source ends the preempt channel after its last
+         * page; otherwise do not wait for data that will never come.
+         */
+        if (!mis->postcopy_qemufile_dst) {
+            qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+        } else if (mis->state == MIGRATION_STATUS_FAILED) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -553,9 +590,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_page[i]) {
+            munmap(mis->postcopy_tmp_page[i], mis->largest_page_size);
+            mis->postcopy_tmp_page[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -564,6 +603,13 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     trace_postcopy_ram_incoming_cleanup_blocktime(
             get_postcopy_total_blocktime());
 
+    qemu_mutex_lock(&mis->fault_latency_mutex);
+    if (mis->fault_latency_pending) {
+        g_hash_table_destroy(mis->fault_latency_pending);
+        mis->fault_latency_pending = NULL;
+    }
+    qemu_mutex_unlock(&mis->fault_latency_mutex);
+
     trace_postcopy_ram_incoming_cleanup_exit();
     return 0;
 }
@@ -830,6 +876,137 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                       affected_cpu);
 }
 
+/*
+ * Remember when a host page faulted, for the fault latency histogram.
+ *
+ * @host: faulted host page
+ * @rb: ramblock appropriate to host
+ */
+static void postcopy_fault_latency_begin(MigrationIncomingState *mis,
+                                         void *host, RAMBlock *rb)
+{
+    qemu_mutex_lock(&mis->fault_latency_mutex);
+    if (mis->fault_latency_pending &&
+        !g_hash_table_contains(mis->fault_latency_pending, host)) {
+        int64_t *start = g_new(int64_t, 1);
+
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(mis->fault_latency_pending, host, start);
+        /* As in mark_postcopy_blocktime_begin, it may have arrived */
+        if (ramblock_recv_bitmap_test(rb, host)) {
+            g_hash_table_remove(mis->fault_latency_pending, host);
+        }
+    }
+    qemu_mutex_unlock(&mis->fault_latency_mutex);
+}
+
+/*
+ * Account the latency of a faulted host page that was just placed.
+ *
+ * @host: host page
+ */
+static void postcopy_fault_latency_end(void *host)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int64_t *start;
+
+    qemu_mutex_lock(&mis->fault_latency_mutex);
+    start = mis->fault_latency_pending ?
+            g_hash_table_lookup(mis->fault_latency_pending, host) : NULL;
+    if (start) {
+        uint64_t us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start) /
+                      SCALE_US;
+        int bucket = us < 2 ? 0 : 63 - clz64(us);
+
+        bucket = MIN(bucket, POSTCOPY_FAULT_LATENCY_BUCKETS - 1);
+        mis->fault_latency[bucket]++;
+        trace_postcopy_fault_latency(host, us);
+        g_hash_table_remove(mis->fault_latency_pending, host);
+    }
+    qemu_mutex_unlock(&mis->fault_latency_mutex);
+}
+
+/*
+ * Upper bound on the memory prefetched for one fault, and on the stride
+ * followed, so that huge host pages don't turn a fault into gigabytes of
+ * transfer
+ */
+#define POSTCOPY_PREFETCH_MAX_BYTES (64 * MiB)
+
+/*
+ * Request pages ahead of a fault, so that a guest walking its memory
+ * finds them placed instead of faulting on each one in turn.  When the
+ * last two faults in a RAMBlock were the same distance apart, pages are
+ * requested along that stride; otherwise the pages following the fault.
+ * The source sends them after the pages that faults are waiting for.
+ *
+ * @rb: ramblock of the fault
+ * @rb_offset: host page aligned offset of the fault in @rb
+ */
+static int postcopy_request_prefetch(MigrationIncomingState *mis,
+                                     RAMBlock *rb, ram_addr_t rb_offset)
+{
+    int64_t pagesize = qemu_ram_pagesize(rb);
+    int64_t used_length = qemu_ram_get_used_length(rb);
+    int64_t depth = MIN(migrate_postcopy_prefetch_pages(),
+                        POSTCOPY_PREFETCH_MAX_BYTES / pagesize);
+    int64_t stride = pagesize;
+    int64_t delta = 0;
+    int64_t i = 1;
+    int ret;
+
+    /* Sources that don't know the capability can't handle the requests */
+    if (!depth || !migrate_postcopy_prefetch()) {
+        return 0;
+    }
+
+    if (rb == mis->prefetch_rb) {
+        delta = (int64_t)rb_offset - (int64_t)mis->prefetch_offset;
+        if (delta > 0 && delta <= POSTCOPY_PREFETCH_MAX_BYTES &&
+            delta == mis->prefetch_delta) {
+            stride = delta;
+        }
+        /*
+         * Don't ask again for what the last fault already prefetched,
+         * if this one is inside that window
+         */
+        if (stride == mis->prefetch_stride &&
+            rb_offset > mis->prefetch_offset &&
+            rb_offset < mis->prefetch_next) {
+            i = MAX(((int64_t)mis->prefetch_next - (int64_t)rb_offset) /
+                    stride, 1);
+        }
+    }
+    mis->prefetch_rb = rb;
+    mis->prefetch_offset = rb_offset;
+    mis->prefetch_delta = delta;
+    mis->prefetch_stride = stride;
+
+    if (i > depth) {
+        return 0;
+    }
+
+    for (; i <= depth; i++) {
+        int64_t offset = (int64_t)rb_offset + i * stride;
+
+        if (offset >= used_length) {
+            break;
+        }
+        if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+            continue;
+        }
+        trace_postcopy_prefetch(qemu_ram_get_idstr(rb), offset, stride);
+        /* The request for the fault itself already named the RAMBlock */
+        ret = migrate_send_rp_prefetch_pages(mis, offset, pagesize);
+        if (ret) {
+            return ret;
+        }
+    }
+    mis->prefetch_next = rb_offset + i * stride;
+
+    return 0;
+}
+
 static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
 {
     trace_postcopy_pause_fault_thread();
@@ -854,6 +1031,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
     trace_postcopy_ram_fault_thread_entry();
     mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    mis->prefetch_rb = NULL; /* no faults to prefetch around yet */
     qemu_sem_post(&mis->fault_thread_sem);
 
     struct pollfd *pfd;
@@ -968,6 +1146,10 @@ static void *postcopy_ram_fault_thread(void *opaque)
             mark_postcopy_blocktime_begin(
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
+            postcopy_fault_latency_begin(mis,
+                    (void *)(uintptr_t)(msg.arg.pagefault.address &
+                                        ~(uint64_t)(qemu_ram_pagesize(rb) - 1)),
+                    rb);
 
 retry:
             /*
@@ -987,6 +1169,9 @@ retry:
                                                 rb_offset,
                                                 qemu_ram_pagesize(rb));
             }
+            if (!ret) {
+                ret = postcopy_request_prefetch(mis, rb, rb_offset);
+            }
 
             if (ret) {
                 /* May be network failure, try to wait for recovery */
@@ -1064,6 +1249,28 @@ retry:
     return NULL;
 }
 
+/*
+ * Returns a zeroed page of the largest host page size, used to place
+ * zero pages where UFFDIO_ZEROPAGE is not available.
+ */
+static void *postcopy_get_tmp_zero_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_zero_page) {
+        mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS,
+                                           -1, 0);
+        if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+            mis->postcopy_tmp_zero_page = NULL;
+            error_report("%s: %s mapping large zero page",
+                         __func__, strerror(errno));
+            return NULL;
+        }
+        memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+    }
+    return mis->postcopy_tmp_zero_page;
+}
+
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1091,6 +1298,20 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    /*
+     * With postcopy-preempt, pages are placed by two threads; allocate
+     * the shared zero page before they start.
+     */
+    if (migrate_postcopy_preempt() && !postcopy_get_tmp_zero_page(mis)) {
+        return -1;
+    }
+
+    qemu_mutex_lock(&mis->fault_latency_mutex);
+    mis->fault_latency_pending = g_hash_table_new_full(NULL, NULL, NULL,
+                                                       g_free);
+    memset(mis->fault_latency, 0, sizeof(mis->fault_latency));
+    qemu_mutex_unlock(&mis->fault_latency_mutex);
+
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -1136,6 +1357,7 @@ static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
+        postcopy_fault_latency_end(host_addr);
 
     }
     return ret;
@@ -1173,6 +1395,12 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
      */
     if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, from, pagesize, rb)) {
         int e = errno;
+
+        if (e == EEXIST && migrate_postcopy_preempt()) {
+            /* Already placed from the other channel */
+            trace_postcopy_place_page_exists(host);
+            return 0;
+        }
         error_report("%s: %s copy host: %p from: %p (size: %zd)",
                      __func__, strerror(e), host, from, pagesize);
 
@@ -1200,6 +1428,12 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     if (qemu_ram_is_uf_zeroable(rb)) {
         if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, NULL, pagesize, rb)) {
             int e = errno;
+
+            if (e == EEXIST && migrate_postcopy_preempt()) {
+                /* Already placed from the other channel */
+                trace_postcopy_place_page_exists(host);
+                return 0;
+            }
             error_report("%s: %s zero host: %p",
                          __func__, strerror(e), host);
 
@@ -1210,22 +1444,12 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
-                int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
-                error_report("%s: %s mapping large zero page",
-                             __func__, strerror(e));
-                return -e;
-            }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+        void *zero_page = postcopy_get_tmp_zero_page(mis);
+
+        if (!zero_page) {
+            return -ENOMEM;
         }
-        return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
-                                   rb);
+        return postcopy_place_page(mis, host, zero_page, rb);
     }
 }
 
@@ -1237,20 +1461,167 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
+    if (!mis->postcopy_tmp_page[channel]) {
+        mis->postcopy_tmp_page[channel] = mmap(NULL, mis->largest_page_size,
                              PROT_READ | PROT_WRITE, MAP_PRIVATE |
                              MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+        if (mis->postcopy_tmp_page[channel] == MAP_FAILED) {
+            mis->postcopy_tmp_page[channel] = NULL;
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
     }
 
-    return mis->postcopy_tmp_page;
+    return mis->postcopy_tmp_page[channel];
+}
+
+/*
+ * Load the pages sent on the postcopy preempt channel, until the source
+ * ends it.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f;
+    int ret;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    /* Normally connected long before postcopy starts */
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    f = mis->postcopy_qemufile_dst;
+    if (f) {
+        qemu_file_set_blocking(f, true);
+
+        rcu_read_lock();
+        ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+        rcu_read_unlock();
+
+        if (ret < 0) {
+            error_report("%s: loading failed: %d", __func__, ret);
+            /*
+             * Requested pages may have been lost, let the main channel
+             * fail too so that postcopy pauses or fails.
+             */
+            qemu_file_shutdown(mis->from_src_file);
+        }
+    }
+
+    trace_postcopy_preempt_thread_exit();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void postcopy_preempt_thread_start(MigrationIncomingState *mis)
+{
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_preempt_thread = true;
+}
+
+/*
+ * Write protection, used on the source side by background snapshots
+ * to catch the first guest write to each page.
+ */
+int uffd_wp_open(void)
+{
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (ufd == -1) {
+        error_report("%s: syscall __NR_userfaultfd failed: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    if (!request_ufd_features(ufd, UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        close(ufd);
+        return -1;
+    }
+    return ufd;
+}
+
+int uffd_wp_register(int ufd, void *host_addr, size_t length)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: userfault register: %s", __func__, strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: no write protection for %p", __func__, host_addr);
+        return -1;
+    }
+    return 0;
+}
+
+int uffd_wp_protect(int ufd, void *host_addr, size_t length, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = (uintptr_t)host_addr;
+    wp_struct.range.len = length;
+    /* Removing the protection also wakes up the threads that hit it */
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        int e = errno;
+        error_report("%s: %s %p/%zx: %s", __func__,
+                     wp ? "protect" : "unprotect", host_addr, length,
+                     strerror(e));
+        return -e;
+    }
+    return 0;
+}
+
+void *uffd_wp_read_fault(int ufd)
+{
+    struct uffd_msg msg;
+
+    while (read(ufd, &msg, sizeof(msg)) == sizeof(msg)) {
+        if (msg.event == UFFD_EVENT_PAGEFAULT &&
+            (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            return (void *)(uintptr_t)msg.arg.pagefault.address;
+        }
+    }
+    /* EAGAIN: nobody is waiting */
+    return NULL;
+}
+
+bool uffd_wp_supported_by_host(void)
+{
+    uint64_t features;
+    void *area;
+    int ufd;
+    bool ret = false;
+
+    if (!receive_ufd_features(&features) ||
+        !(features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        return false;
+    }
+
+    /* The feature bit says nothing about anonymous memory; try it */
+    ufd = uffd_wp_open();
+    if (ufd < 0) {
+        return false;
+    }
+    area = mmap(NULL, qemu_real_host_page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area != MAP_FAILED) {
+        ret = !uffd_wp_register(ufd, area, qemu_real_host_page_size) &&
+              !uffd_wp_protect(ufd, area, qemu_real_host_page_size, true);
+        munmap(area, qemu_real_host_page_size);
+    }
+    close(ufd);
+    return ret;
 }
 
 #else
@@ -1310,12 +1681,17 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
 }
 
+void postcopy_preempt_thread_start(MigrationIncomingState *mis)
+{
+    assert(0);
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1323,10 +1699,115 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     assert(0);
     return -1;
 }
+
+int uffd_wp_open(void)
+{
+    assert(0);
+    return -1;
+}
+
+int uffd_wp_register(int ufd, void *host_addr, size_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int uffd_wp_protect(int ufd, void *host_addr, size_t length, bool wp)
+{
+    assert(0);
+    return -1;
+}
+
+void *uffd_wp_read_fault(int ufd)
+{
+    assert(0);
+    return NULL;
+}
+
+bool uffd_wp_supported_by_host(void)
+{
+    return false;
+}
 #endif
 
 /* ------------------------------------------------------------------------- */
 
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+    QEMUFile *f;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        error_prepend(&local_err,
+                      "Failed to connect the postcopy preempt channel: ");
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+    } else {
+        f = qemu_fopen_channel_output(ioc);
+        qemu_file_set_blocking(f, true);
+
+        qemu_mutex_lock(&s->qemu_file_lock);
+        s->postcopy_qemufile_src = f;
+        qemu_mutex_unlock(&s->qemu_file_lock);
+        trace_postcopy_preempt_new_channel();
+    }
+
+    /* The waiter looks at postcopy_qemufile_src to tell how it went */
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+    object_unref(OBJECT(ioc));
+}
+
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!socket_send_channel_available()) {
+        error_setg(errp, "Postcopy preempt needs a socket transport");
+        return -1;
+    }
+
+    /*
+     * Connected after the main channel, so the destination tells them
+     * apart.  The connection completes in the main loop, while the
+     * migration thread sets up; postcopy_preempt_wait_channel() collects
+     * it.
+     */
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    trace_postcopy_preempt_setup();
+    return 0;
+}
+
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    return s->postcopy_qemufile_src ? 0 : -1;
+}
+
+void postcopy_preempt_close(MigrationState *s)
+{
+    QEMUFile *f;
+
+    qemu_mutex_lock(&s->qemu_file_lock);
+    f = s->postcopy_qemufile_src;
+    s->postcopy_qemufile_src = NULL;
+    qemu_mutex_unlock(&s->qemu_file_lock);
+
+    if (f) {
+        /* Nobody reads it anymore unless the migration completed */
+        if (s->state != MIGRATION_STATUS_COMPLETED) {
+            qemu_file_shutdown(f);
+        }
+        qemu_fclose(f);
+    }
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = f;
+    qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
@@ -105,10 +105,23 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page; each RAM channel has its own.
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
+
+/*
+ * Postcopy preempt channel: the source starts connecting it with
+ * postcopy_preempt_setup, waits for the connection from the migration
+ * thread with postcopy_preempt_wait_channel, and sends requested pages on
+ * it during postcopy; the destination loads them from a thread started
+ * when postcopy starts listening.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+void postcopy_preempt_close(MigrationState *s);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+void postcopy_preempt_thread_start(MigrationIncomingState *mis);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -116,6 +129,19 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/*
+ * Userfaultfd write protection, used on the source by background
+ * snapshots.
+ */
+bool uffd_wp_supported_by_host(void);
+/* Returns a non-blocking userfaultfd with write protection enabled, or -1 */
+int uffd_wp_open(void);
+int uffd_wp_register(int ufd, void *host_addr, size_t length);
+/* Removing the protection wakes up the threads waiting on the range */
+int uffd_wp_protect(int ufd, void *host_addr, size_t length, bool wp);
+/* Returns the address of a pending write fault, or NULL if there is none */
+void *uffd_wp_read_fault(int ufd);
+
 /*
  * To be called once at the start before any device initialisation
  */
@@ -25,7 +25,9 @@
 #include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 #include "qemu/iov.h"
+#include "io/channel.h"
 #include "migration.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -78,6 +80,17 @@ QEMUFile *qemu_file_get_return_path(QEMUFile *f)
     return f->ops->get_return_path(f->opaque);
 }
 
+/*
+ * Result: the channel backing the file, NULL if not channel based
+ */
+QIOChannel *qemu_file_get_ioc(QEMUFile *f)
+{
+    if (!f->ops->get_ioc) {
+        return NULL;
+    }
+    return f->ops->get_ioc(f->opaque);
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -586,6 +599,67 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Return the offset of the stream in the underlying channel, taking
+ * into account any data still sitting in the buffer.  Only makes sense
+ * for seekable channels.
+ */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+    off_t ret;
+
+    if (!ioc) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    }
+
+    ret = qio_channel_io_seek(ioc, 0, SEEK_CUR, &local_err);
+    if (ret < 0) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+
+    if (!qemu_file_is_writable(f)) {
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Move the stream to a new offset of the underlying channel.  Pending
+ * output is flushed first and buffered input is discarded.
+ */
+void qemu_set_offset(QEMUFile *f, int64_t off, int whence)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        if (whence == SEEK_CUR) {
+            off -= f->buf_size - f->buf_index;
+        }
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (qio_channel_io_seek(ioc, off, whence, &local_err) < 0) {
+        error_report_err(local_err);
+        qemu_file_set_error(f, -EIO);
+    }
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -597,6 +671,15 @@ int qemu_file_rate_limit(QEMUFile *f)
     return 0;
 }
 
+/*
+ * Count data written to the channel behind the back of the QEMUFile
+ * against the rate limit
+ */
+void qemu_file_acct_rate_limit(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 int64_t qemu_file_get_rate_limit(QEMUFile *f)
 {
     return f->xfer_limit;
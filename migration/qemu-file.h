@@ -99,6 +99,12 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Return the channel backing the QEMUFile, or NULL if the backend
+ * is not channel based.
+ */
+typedef struct QIOChannel *(QEMUFileGetIOCFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +112,7 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileGetIOCFunc *get_ioc;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -129,6 +136,9 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
                            bool may_free);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
+struct QIOChannel *qemu_file_get_ioc(QEMUFile *f);
+int64_t qemu_get_offset(QEMUFile *f);
+void qemu_set_offset(QEMUFile *f, int64_t off, int whence);
 
 #include "migration/qemu-file-types.h"
 
@@ -149,6 +159,7 @@ void qemu_update_position(QEMUFile *f, size_t size);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
+void qemu_file_acct_rate_limit(QEMUFile *f, int64_t len);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
@@ -34,9 +34,11 @@
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
 #include "xbzrle.h"
+#include "multifd-compress.h"
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "migration/register.h"
 #include "migration/misc.h"
 #include "qemu-file.h"
@@ -53,9 +55,12 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/balloon.h"
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "qemu/stats64.h"
+#include "io/channel.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -81,6 +86,73 @@ static inline bool is_zero_range(uint8_t *p, uint64_t size)
     return buffer_is_zero(p, size);
 }
 
+/*
+ * With mapped-ram, the header of each block in the stream is followed
+ * by a bitmap of the pages present in the file and then by room for
+ * every page of the block at its own offset, so that a page sent again
+ * overwrites its previous copy.  The stream goes on after that room.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+/* Pages start on an aligned offset, so the file can be mapped as is */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT 0x100000
+
+/**
+ * mapped_ram_write_pages: write pages of a block to their place in the file
+ *
+ * A zero page that is not in the file yet is skipped, the file reads
+ * as zeroes there and the destination RAM starts zeroed.  The bits are
+ * set atomically since several multifd channels may write pages of the
+ * same bitmap word.  Runs of contiguous pages are written at once.
+ *
+ * Returns the number of pages written or -1 for error
+ *
+ * @ioc: channel on the migration file
+ * @block: block that contains the pages
+ * @offsets: offsets of the pages inside the block
+ * @iov: the pages, one per entry
+ * @used: number of pages
+ * @errp: pointer to a NULL-initialized error object
+ */
+static int64_t mapped_ram_write_pages(QIOChannel *ioc, RAMBlock *block,
+                                      ram_addr_t *offsets, struct iovec *iov,
+                                      uint32_t used, Error **errp)
+{
+    int64_t written = 0;
+    uint32_t i = 0;
+
+    while (i < used) {
+        unsigned long page = offsets[i] >> TARGET_PAGE_BITS;
+        uint32_t run;
+
+        if (!test_bit(page, block->file_bmap) &&
+            is_zero_range(iov[i].iov_base, TARGET_PAGE_SIZE)) {
+            i++;
+            continue;
+        }
+
+        set_bit_atomic(page, block->file_bmap);
+        for (run = 1; i + run < used; run++) {
+            unsigned long next = offsets[i + run] >> TARGET_PAGE_BITS;
+
+            if (next != page + run ||
+                (!test_bit(next, block->file_bmap) &&
+                 is_zero_range(iov[i + run].iov_base, TARGET_PAGE_SIZE))) {
+                break;
+            }
+            set_bit_atomic(next, block->file_bmap);
+        }
+
+        if (qio_channel_pwritev_all(ioc, &iov[i], run,
+                                    block->pages_offset + offsets[i],
+                                    errp) < 0) {
+            return -1;
+        }
+        written += run;
+        i += run;
+    }
+    return written;
+}
+
 XBZRLECacheStats xbzrle_counters;
 
 /* struct contains XBZRLE cache and a static page
@@ -165,13 +237,30 @@ out:
 
 #undef RAMBLOCK_FOREACH
 
+/*
+ * The receive bitmaps are allocated by whichever comes first of
+ * ram_load_setup() and multifd_load_setup(), since the multifd channels
+ * may deliver pages before the main stream reaches the RAM setup.
+ */
 static void ramblock_recv_map_init(void)
 {
     RAMBlock *rb;
 
     RAMBLOCK_FOREACH_MIGRATABLE(rb) {
-        assert(!rb->receivedmap);
-        rb->receivedmap = bitmap_new(rb->max_length >> qemu_target_page_bits());
+        if (!rb->receivedmap) {
+            rb->receivedmap =
+                bitmap_new(rb->max_length >> qemu_target_page_bits());
+        }
+    }
+}
+
+static void ramblock_recv_map_free(void)
+{
+    RAMBlock *rb;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+        g_free(rb->receivedmap);
+        rb->receivedmap = NULL;
     }
 }
 
@@ -283,6 +372,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Same, on the postcopy preempt channel */
+    RAMBlock *preempt_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -291,6 +382,12 @@ struct RAMState {
     bool ram_bulk_stage;
     /* How many times we have dirty too many pages */
     int dirty_rate_high_cnt;
+    /* per-vCPU dirty page counters at the start of the period */
+    uint64_t *vcpu_dirty_prev;
+    /* pages dirtied by each vCPU during the last period */
+    uint64_t *vcpu_dirty_period;
+    /* vCPUs are throttled individually by mig_throttle_vcpus */
+    bool vcpu_throttled;
     /* these variables are used for bitmap sync */
     /* last time we did a full bitmap_sync */
     int64_t time_last_bitmap_sync;
@@ -313,6 +410,15 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests;
+    /*
+     * Pages the destination prefetches.  They are sent on the main
+     * channel when no requested page is waiting, within the rate limit.
+     */
+    struct src_page_requests src_prefetch_requests;
+    /* userfaultfd write-protecting guest RAM for background snapshots */
+    int uffdio_fd;
+    /* Ballooning is inhibited while guest RAM is write-tracked */
+    bool balloon_inhibited;
 };
 typedef struct RAMState RAMState;
 
@@ -509,10 +615,26 @@ exit:
 /* Multiple fd's */
 
 #define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
+#define MULTIFD_VERSION 2
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
+/* Bits 1-3 of the packet flags hold the MultiFDCompression of its data */
+#define MULTIFD_FLAG_COMPRESSION_SHIFT 1
+#define MULTIFD_FLAG_COMPRESSION_MASK (7 << MULTIFD_FLAG_COMPRESSION_SHIFT)
+
+/*
+ * Each page offset of a packet carries the encoding of the page in its
+ * low bits, which are always zero because offsets are page aligned.
+ * Zero pages have no data in the stream; the data of the normal pages
+ * follows the packet, in order, compressed as a whole.
+ */
+#define MULTIFD_PAGE_NORMAL 0
+#define MULTIFD_PAGE_ZERO   1
+
+/* Upper bound of the data that follows a packet of @pages normal pages */
+#define MULTIFD_DATA_MAX(pages) MULTIFD_COMPRESS_MAX(pages, TARGET_PAGE_SIZE)
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -524,8 +646,12 @@ typedef struct {
     uint32_t magic;
     uint32_t version;
     uint32_t flags;
+    /* maximum number of allocated pages */
     uint32_t size;
+    /* number of pages in this packet */
     uint32_t used;
+    /* size of the page data that follows this packet */
+    uint32_t next_packet_size;
     uint64_t packet_num;
     char ramblock[256];
     uint64_t offset[];
@@ -575,11 +701,27 @@ typedef struct {
     uint32_t flags;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* slice of a dirty bitmap this channel has to scan */
+    RAMBlock *scan_block;
+    unsigned long scan_start;
+    unsigned long scan_end;
+    /* first packet number reserved for the slice */
+    uint64_t scan_packet_num;
+    /* dirty pages found in the last slice */
+    uint64_t scan_pages;
+    /* compression method of this channel */
+    MultiFDCompression compression;
+    /* compression level of this channel */
+    int compression_level;
     /* thread local variables */
+    /* compression state, NULL without compression */
+    void *data;
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found by this channel */
+    uint64_t num_zero_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
 }  MultiFDSendParams;
@@ -608,7 +750,18 @@ typedef struct {
     uint32_t flags;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* block of the pages of the packet */
+    RAMBlock *block;
+    /* normal pages of the packet, at the start of pages->iov */
+    uint32_t normal_num;
+    /* size of the page data that follows the packet */
+    uint32_t next_packet_size;
     /* thread local variables */
+    /* decompression state of each method, set up on first use */
+    void *data[MULTIFD_COMPRESSION__MAX];
+    /* buffer for the compressed page data */
+    uint8_t *zbuff;
+    uint32_t zbuff_len;
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
@@ -703,23 +856,26 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t used,
+                                     uint32_t flags, uint64_t packet_num,
+                                     uint32_t next_packet_size)
 {
     MultiFDPacket_t *packet = p->packet;
     int i;
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
     packet->version = cpu_to_be32(MULTIFD_VERSION);
-    packet->flags = cpu_to_be32(p->flags);
-    packet->size = cpu_to_be32(migrate_multifd_page_count());
-    packet->used = cpu_to_be32(p->pages->used);
-    packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->flags = cpu_to_be32(flags);
+    packet->size = cpu_to_be32(p->pages->allocated);
+    packet->used = cpu_to_be32(used);
+    packet->next_packet_size = cpu_to_be32(next_packet_size);
+    packet->packet_num = cpu_to_be64(packet_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < used; i++) {
         packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
     }
 }
@@ -747,6 +903,13 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->flags = be32_to_cpu(packet->flags);
+    if (!multifd_compression_supported((p->flags &
+                                        MULTIFD_FLAG_COMPRESSION_MASK) >>
+                                       MULTIFD_FLAG_COMPRESSION_SHIFT)) {
+        error_setg(errp, "multifd: received packet "
+                   "with unsupported compression flags %x", p->flags);
+        return -1;
+    }
 
     be32_to_cpus(&packet->size);
     if (packet->size > migrate_multifd_page_count()) {
@@ -764,8 +927,10 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
+    p->block = NULL;
     if (p->pages->used) {
         /* make sure that ramblock is 0 terminated */
         packet->ramblock[255] = 0;
@@ -775,19 +940,53 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        packet->ramblock);
             return -1;
         }
+        p->block = block;
     }
 
+    /*
+     * Normal pages go to the start of pages->iov in packet order, zero
+     * pages to its end.
+     */
+    p->normal_num = 0;
     for (i = 0; i < p->pages->used; i++) {
         ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+        ram_addr_t encoding = offset & ~TARGET_PAGE_MASK;
+        struct iovec *iov;
 
+        offset &= TARGET_PAGE_MASK;
         if (offset > (block->used_length - TARGET_PAGE_SIZE)) {
             error_setg(errp, "multifd: offset too long " RAM_ADDR_FMT
                        " (max " RAM_ADDR_FMT ")",
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+        if (encoding == MULTIFD_PAGE_NORMAL) {
+            iov = &p->pages->iov[p->normal_num++];
+        } else if (encoding == MULTIFD_PAGE_ZERO) {
+            iov = &p->pages->iov[p->pages->used - 1 - (i - p->normal_num)];
+        } else {
+            error_setg(errp, "multifd: unknown page encoding " RAM_ADDR_FMT,
+                       encoding);
+            return -1;
+        }
+        iov->iov_base = block->host + offset;
+        iov->iov_len = TARGET_PAGE_SIZE;
+    }
+
+    if ((p->flags & MULTIFD_FLAG_COMPRESSION_MASK) ==
+        MULTIFD_COMPRESSION_NONE << MULTIFD_FLAG_COMPRESSION_SHIFT) {
+        if (p->next_packet_size != p->normal_num * TARGET_PAGE_SIZE) {
+            error_setg(errp, "multifd: received packet with %u normal "
+                       "pages and data size %u", p->normal_num,
+                       p->next_packet_size);
+            return -1;
+        }
+    } else if (!p->normal_num != !p->next_packet_size ||
+               p->next_packet_size > MULTIFD_DATA_MAX(p->normal_num)) {
+        error_setg(errp, "multifd: received packet with %u normal "
+                   "pages and compressed size %u", p->normal_num,
+                   p->next_packet_size);
+        return -1;
     }
 
     return 0;
@@ -805,6 +1004,18 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* channels done with their slice of the dirty bitmaps */
+    QemuSemaphore scan_done;
+    /* bytes and pages sent by the channels */
+    Stat64 bytes;
+    Stat64 normal_pages;
+    Stat64 zero_pages;
+    /* syncs where the kernel copied some zero copy data after all */
+    Stat64 zero_copy_copied;
+    /* part of the above already added to ram_counters */
+    uint64_t bytes_accounted;
+    uint64_t normal_pages_accounted;
+    uint64_t zero_pages_accounted;
 } *multifd_send_state;
 
 /*
@@ -825,13 +1036,34 @@ struct {
  * false.
  */
 
+/*
+ * Only the channels know how many bytes they sent after compression and
+ * which pages were zero.  Add what they did since the last call to
+ * ram_counters.
+ */
+static void multifd_send_account(void)
+{
+    uint64_t bytes = stat64_get(&multifd_send_state->bytes);
+    uint64_t normal = stat64_get(&multifd_send_state->normal_pages);
+    uint64_t zero = stat64_get(&multifd_send_state->zero_pages);
+
+    ram_counters.multifd_bytes += bytes - multifd_send_state->bytes_accounted;
+    ram_counters.transferred += bytes - multifd_send_state->bytes_accounted;
+    ram_counters.normal += normal - multifd_send_state->normal_pages_accounted;
+    ram_counters.duplicate += zero - multifd_send_state->zero_pages_accounted;
+    multifd_send_state->bytes_accounted = bytes;
+    multifd_send_state->normal_pages_accounted = normal;
+    multifd_send_state->zero_pages_accounted = zero;
+    ram_counters.dirty_sync_missed_zero_copy =
+        stat64_get(&multifd_send_state->zero_copy_copied);
+}
+
 static void multifd_send_pages(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
@@ -851,11 +1083,9 @@ static void multifd_send_pages(void)
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = pages->used * TARGET_PAGE_SIZE + p->packet_len;
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
+    multifd_send_account();
 }
 
 static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
@@ -925,7 +1155,11 @@ int multifd_save_cleanup(Error **errp)
         if (p->running) {
             qemu_thread_join(&p->thread);
         }
-        socket_send_channel_destroy(p->c);
+        if (migrate_mapped_ram()) {
+            object_unref(OBJECT(p->c));
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -937,8 +1171,13 @@ int multifd_save_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        if (p->data) {
+            multifd_compress_methods(p->compression)->send_cleanup(p->data);
+            p->data = NULL;
+        }
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_sem_destroy(&multifd_send_state->scan_done);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
@@ -978,22 +1217,200 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    multifd_send_account();
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Mark the zero pages among the first @used pages of the channel and
+ * move the iovs of the others to the start of pages->iov, keeping their
+ * order.  Return the number of normal pages.
+ */
+static uint32_t multifd_send_zero_pages(MultiFDSendParams *p, uint32_t used)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i, normal = 0;
+
+    for (i = 0; i < used; i++) {
+        if (is_zero_range(pages->iov[i].iov_base, TARGET_PAGE_SIZE)) {
+            pages->offset[i] |= MULTIFD_PAGE_ZERO;
+        } else {
+            pages->iov[normal++] = pages->iov[i];
+        }
+    }
+    return normal;
+}
+
+/*
+ * With mapped-ram there are no packets, the channel writes the first
+ * @used pages straight to their place in the file
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, uint32_t used,
+                                    Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    int64_t normal;
+
+    if (!used) {
+        return 0;
+    }
+
+    normal = mapped_ram_write_pages(p->c, pages->block, pages->offset,
+                                    pages->iov, used, errp);
+    if (normal < 0) {
+        return -1;
+    }
+
+    p->num_zero_pages += used - normal;
+    stat64_add(&multifd_send_state->bytes, normal * TARGET_PAGE_SIZE);
+    stat64_add(&multifd_send_state->normal_pages, normal);
+    stat64_add(&multifd_send_state->zero_pages, used - normal);
+    return 0;
+}
+
+/*
+ * Send the first @used pages of the channel as one packet
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int multifd_send_packet(MultiFDSendParams *p, uint32_t used,
+                               uint32_t flags, uint64_t packet_num,
+                               Error **errp)
+{
+    const MultiFDMethods *methods = multifd_compress_methods(p->compression);
+    uint32_t normal, next_packet_size;
+    uint8_t *buf = NULL;
+    int ret;
+
+    if (migrate_mapped_ram()) {
+        return multifd_file_write_pages(p, used, errp);
+    }
+
+    normal = multifd_send_zero_pages(p, used);
+    next_packet_size = normal * TARGET_PAGE_SIZE;
+    if (normal && methods) {
+        ret = methods->send_prepare(p->data, p->pages->iov, normal,
+                                    &buf, &next_packet_size, errp);
+        if (ret != 0) {
+            return -1;
+        }
+        flags |= p->compression << MULTIFD_FLAG_COMPRESSION_SHIFT;
+    }
+    multifd_send_fill_packet(p, used, flags, packet_num, next_packet_size);
+
+    trace_multifd_send(p->id, packet_num, used, normal, flags,
+                       next_packet_size);
+
+    ret = qio_channel_write_all(p->c, (void *)p->packet, p->packet_len, errp);
+    if (ret != 0) {
+        return -1;
+    }
+
+    if (buf) {
+        ret = qio_channel_write_all(p->c, (char *)buf, next_packet_size,
+                                    errp);
+    } else {
+        /*
+         * Guest RAM stays put, so it can be sent without a copy; the
+         * header above is always copied since p->packet gets reused.
+         */
+        ret = qio_channel_writev_full_all(p->c, p->pages->iov, normal,
+                                          NULL, 0,
+                                          migrate_use_zero_copy_send() ?
+                                          QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0,
+                                          errp);
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    p->num_zero_pages += used - normal;
+    stat64_add(&multifd_send_state->bytes, p->packet_len + next_packet_size);
+    stat64_add(&multifd_send_state->normal_pages, normal);
+    stat64_add(&multifd_send_state->zero_pages, used - normal);
+    return 0;
+}
+
+/*
+ * Find, clear and send the dirty pages of pages [@start, @end) of @block.
+ *
+ * Slices handed to the channels start on a bitmap word boundary, so no
+ * two channels ever touch the same word, and the migration thread
+ * waits for the channels before using the bitmaps again.
+ *
+ * Returns the number of dirty pages found or -1 for error
+ */
+static int64_t multifd_send_scan(MultiFDSendParams *p, RAMBlock *block,
+                                 unsigned long start, unsigned long end,
+                                 uint64_t packet_num, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    unsigned long *bitmap = block->bmap;
+    unsigned long page = find_next_bit(bitmap, end, start);
+    int64_t found = 0;
+
+    pages->block = block;
+    pages->used = 0;
+    while (page < end) {
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+        clear_bit(page, bitmap);
+        pages->offset[pages->used] = offset;
+        pages->iov[pages->used].iov_base = block->host + offset;
+        pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+        found++;
+
+        if (++pages->used == pages->allocated) {
+            if (multifd_send_packet(p, pages->used, 0, packet_num++,
+                                    errp) < 0) {
+                return -1;
+            }
+            p->num_packets++;
+            p->num_pages += pages->used;
+            pages->used = 0;
+        }
+        page = find_next_bit(bitmap, end, page + 1);
+    }
+
+    if (pages->used) {
+        if (multifd_send_packet(p, pages->used, 0, packet_num, errp) < 0) {
+            return -1;
+        }
+        p->num_packets++;
+        p->num_pages += pages->used;
+        pages->used = 0;
+    }
+    pages->block = NULL;
+    return found;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
+    const MultiFDMethods *methods = multifd_compress_methods(p->compression);
     Error *local_err = NULL;
     int ret;
 
     trace_multifd_send_thread_start(p->id);
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        goto out;
+    if (methods) {
+        p->data = methods->send_setup(p->pages->allocated, TARGET_PAGE_SIZE,
+                                      p->compression_level, &local_err);
+        if (!p->data) {
+            goto out;
+        }
+    }
+
+    /* The file has no room for per channel data */
+    if (!migrate_mapped_ram()) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -1004,22 +1421,13 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
 
-            multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
             p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags);
-
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
-            if (ret != 0) {
-                break;
-            }
-
-            ret = qio_channel_writev_all(p->c, p->pages->iov, used, &local_err);
+            ret = multifd_send_packet(p, used, flags, packet_num, &local_err);
             if (ret != 0) {
                 break;
             }
@@ -1029,9 +1437,44 @@ static void *multifd_send_thread(void *opaque)
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
+                /*
+                 * Everything sent without a copy must be out before the
+                 * dirty bitmap is synced again and the same pages may be
+                 * sent once more, possibly on another channel.
+                 */
+                if (migrate_use_zero_copy_send()) {
+                    ret = qio_channel_flush(p->c, &local_err);
+                    if (ret < 0) {
+                        break;
+                    }
+                    if (ret == 1) {
+                        stat64_add(&multifd_send_state->zero_copy_copied, 1);
+                    }
+                    trace_multifd_send_flush(p->id, ret);
+                }
                 qemu_sem_post(&multifd_send_state->sem_sync);
             }
             qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->scan_block) {
+            RAMBlock *block = p->scan_block;
+            unsigned long start = p->scan_start;
+            unsigned long end = p->scan_end;
+            uint64_t packet_num = p->scan_packet_num;
+            int64_t found;
+
+            qemu_mutex_unlock(&p->mutex);
+
+            found = multifd_send_scan(p, block, start, end, packet_num,
+                                      &local_err);
+            if (found < 0) {
+                break;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->scan_pages = found;
+            p->scan_block = NULL;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->scan_done);
         } else if (p->quit) {
             qemu_mutex_unlock(&p->mutex);
             break;
@@ -1048,9 +1491,15 @@ out:
 
     qemu_mutex_lock(&p->mutex);
     p->running = false;
+    if (p->scan_block) {
+        /* Don't leave the migration thread waiting for this slice */
+        p->scan_block = NULL;
+        qemu_sem_post(&multifd_send_state->scan_done);
+    }
     qemu_mutex_unlock(&p->mutex);
 
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -1065,6 +1514,15 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
         if (multifd_save_cleanup(&local_err) != 0) {
             migrate_set_error(migrate_get_current(), local_err);
         }
+    } else if (migrate_use_zero_copy_send() &&
+               !qio_channel_has_feature(QIO_CHANNEL(sioc),
+                                        QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd channel %d does not support zero copy "
+                   "send", p->id);
+        object_unref(OBJECT(sioc));
+        if (multifd_save_cleanup(&local_err) != 0) {
+            migrate_set_error(migrate_get_current(), local_err);
+        }
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
@@ -1092,6 +1550,7 @@ int multifd_save_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_sem_init(&multifd_send_state->scan_done, 0);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1106,8 +1565,14 @@ int multifd_save_setup(void)
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        p->compression = migrate_multifd_compression();
+        p->compression_level = migrate_compress_level();
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (migrate_mapped_ram()) {
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
     return 0;
 }
@@ -1151,10 +1616,10 @@ static void multifd_recv_terminate_threads(Error *err)
 
 int multifd_load_cleanup(Error **errp)
 {
-    int i;
+    int i, j;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1175,12 +1640,23 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        for (j = 0; j < MULTIFD_COMPRESSION__MAX; j++) {
+            if (p->data[j]) {
+                multifd_compress_methods(j)->recv_cleanup(p->data[j]);
+                p->data[j] = NULL;
+            }
+        }
+        g_free(p->zbuff);
+        p->zbuff = NULL;
+        p->zbuff_len = 0;
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
     multifd_recv_state = NULL;
+    /* Only now that no thread can set them */
+    ramblock_recv_map_free();
 
     return ret;
 }
@@ -1189,7 +1665,7 @@ static void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1212,6 +1688,107 @@ static void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Merge the iovs of consecutive pages, so that runs of pages are read
+ * with a single iov.  Returns the new number of iovs.
+ */
+static uint32_t multifd_iov_merge(struct iovec *iov, uint32_t num)
+{
+    uint32_t i, n = 0;
+
+    if (!num) {
+        return 0;
+    }
+    for (i = 1; i < num; i++) {
+        if ((uint8_t *)iov[n].iov_base + iov[n].iov_len == iov[i].iov_base) {
+            iov[n].iov_len += iov[i].iov_len;
+        } else {
+            iov[++n] = iov[i];
+        }
+    }
+    return n + 1;
+}
+
+/*
+ * Mark the @used pages of the current packet as received, with one
+ * bitmap update per run of consecutive pages.
+ */
+static void multifd_recv_bitmap_set(MultiFDRecvParams *p, uint32_t used)
+{
+    ram_addr_t first = 0;
+    size_t nr = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = be64_to_cpu(p->packet->offset[i]) &
+                            TARGET_PAGE_MASK;
+
+        if (nr && offset == first + nr * TARGET_PAGE_SIZE) {
+            nr++;
+            continue;
+        }
+        if (nr) {
+            ramblock_recv_bitmap_set_range(p->block, p->block->host + first,
+                                           nr);
+        }
+        first = offset;
+        nr = 1;
+    }
+    if (nr) {
+        ramblock_recv_bitmap_set_range(p->block, p->block->host + first, nr);
+    }
+}
+
+/*
+ * Clear the zero pages of the current packet and read the data of its
+ * normal pages straight into guest memory; compressed data goes
+ * through p->zbuff only.
+ */
+static int multifd_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                              uint32_t flags, Error **errp)
+{
+    MultiFDCompression method = (flags & MULTIFD_FLAG_COMPRESSION_MASK) >>
+                                MULTIFD_FLAG_COMPRESSION_SHIFT;
+    const MultiFDMethods *methods = multifd_compress_methods(method);
+    uint32_t normal = p->normal_num;
+    uint32_t i;
+    int ret;
+
+    for (i = normal; i < used; i++) {
+        ram_handle_compressed(p->pages->iov[i].iov_base, 0, TARGET_PAGE_SIZE);
+    }
+
+    if (!normal) {
+        return 0;
+    }
+    if (!methods) {
+        return qio_channel_readv_all(p->c, p->pages->iov,
+                                     multifd_iov_merge(p->pages->iov, normal),
+                                     errp);
+    }
+
+    if (methods->recv_setup && !p->data[method]) {
+        p->data[method] = methods->recv_setup(errp);
+        if (!p->data[method]) {
+            return -1;
+        }
+    }
+    if (p->next_packet_size > p->zbuff_len) {
+        g_free(p->zbuff);
+        p->zbuff_len = MAX(p->next_packet_size,
+                           MULTIFD_DATA_MAX(p->pages->allocated));
+        p->zbuff = g_malloc(p->zbuff_len);
+    }
+    ret = qio_channel_read_all(p->c, (char *)p->zbuff, p->next_packet_size,
+                               errp);
+    if (ret != 0) {
+        return ret;
+    }
+    return methods->recv_pages(p->data[method], p->zbuff,
+                               p->next_packet_size, p->pages->iov, normal,
+                               errp);
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1242,15 +1819,17 @@ static void *multifd_recv_thread(void *opaque)
 
         used = p->pages->used;
         flags = p->flags;
-        trace_multifd_recv(p->id, p->packet_num, used, flags);
+        trace_multifd_recv(p->id, p->packet_num, used, p->normal_num, flags,
+                           p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
-        ret = qio_channel_readv_all(p->c, p->pages->iov, used, &local_err);
+        ret = multifd_recv_pages(p, used, flags, &local_err);
         if (ret != 0) {
             break;
         }
+        multifd_recv_bitmap_set(p, used);
 
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
@@ -1276,7 +1855,7 @@ int multifd_load_setup(void)
     uint32_t page_count = migrate_multifd_page_count();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return 0;
     }
     thread_count = migrate_multifd_channels();
@@ -1297,6 +1876,7 @@ int multifd_load_setup(void)
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
+    ramblock_recv_map_init();
     return 0;
 }
 
@@ -1304,7 +1884,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return true;
     }
 
@@ -1376,6 +1956,129 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
     return size;
 }
 
+/**
+ * mig_vcpu_dirty_sample: measure how much each vCPU dirtied memory
+ *
+ * Fills rs->vcpu_dirty_period, indexed by cpu_index, with the number of
+ * pages each vCPU dirtied since the previous call.
+ *
+ * Returns the number of pages dirtied by all vCPUs, which is 0 if the
+ * dirty tracking in use cannot tell which vCPU wrote a page (e.g. KVM
+ * without dirty rings).
+ *
+ * @rs: current RAM state
+ */
+static uint64_t mig_vcpu_dirty_sample(RAMState *rs)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    cpu_list_lock();
+    CPU_FOREACH(cpu) {
+        int idx = cpu->cpu_index;
+        uint64_t now;
+
+        if (idx >= max_cpus) {
+            continue;
+        }
+        now = stat64_get(&cpu->dirty_pages);
+        /* a hotplugged vCPU starts counting from zero again */
+        rs->vcpu_dirty_period[idx] = now - MIN(now, rs->vcpu_dirty_prev[idx]);
+        rs->vcpu_dirty_prev[idx] = now;
+        total += rs->vcpu_dirty_period[idx];
+    }
+    cpu_list_unlock();
+
+    return total;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t ua = *(const uint64_t *)a;
+    uint64_t ub = *(const uint64_t *)b;
+
+    return ua < ub ? -1 : ua > ub;
+}
+
+/**
+ * mig_throttle_vcpus: throttle down the vCPUs that dirty memory the most
+ *
+ * The pages that can be dirtied during a period without preventing
+ * convergence, i.e. half of what was transferred, are shared between
+ * the vCPUs.  A vCPU that needs less than its fair share runs freely
+ * and the rest of its share goes to the others; each vCPU that would
+ * dirty more than the resulting limit is throttled so that its dirty
+ * rate comes down to the limit.  Pages dirtied by something else than
+ * a vCPU (e.g. DMA) are taken from the budget first.
+ *
+ * @rs: current RAM state
+ * @vcpu_dirty: pages dirtied by the vCPUs in the period
+ * @bytes_xfer_period: bytes transferred in the period
+ */
+static void mig_throttle_vcpus(RAMState *rs, uint64_t vcpu_dirty,
+                               uint64_t bytes_xfer_period)
+{
+    uint64_t budget = bytes_xfer_period / 2 / TARGET_PAGE_SIZE;
+    uint64_t limit = UINT64_MAX;
+    uint64_t *demand;
+    CPUState *cpu;
+    int i;
+
+    if (rs->num_dirty_pages_period > vcpu_dirty) {
+        budget -= MIN(budget, rs->num_dirty_pages_period - vcpu_dirty);
+    }
+
+    cpu_list_lock();
+
+    /*
+     * The rates were measured with the current throttling in place,
+     * estimate what each vCPU would dirty if it ran freely.
+     */
+    CPU_FOREACH(cpu) {
+        int idx = cpu->cpu_index;
+
+        if (idx < max_cpus) {
+            int pct = atomic_read(&cpu->throttle_percentage);
+
+            rs->vcpu_dirty_period[idx] = rs->vcpu_dirty_period[idx] * 100 /
+                                         (100 - pct);
+        }
+    }
+
+    /* Water-fill the budget, from the smallest demand up */
+    demand = g_memdup(rs->vcpu_dirty_period, max_cpus * sizeof(uint64_t));
+    qsort(demand, max_cpus, sizeof(uint64_t), u64_cmp);
+    for (i = 0; i < max_cpus; i++) {
+        uint64_t share = budget / (max_cpus - i);
+
+        if (demand[i] > share) {
+            limit = share;
+            break;
+        }
+        budget -= demand[i];
+    }
+    g_free(demand);
+
+    CPU_FOREACH(cpu) {
+        int idx = cpu->cpu_index;
+        uint64_t want;
+        int pct = 0;
+
+        if (idx >= max_cpus) {
+            continue;
+        }
+        want = rs->vcpu_dirty_period[idx];
+        if (want > limit) {
+            pct = 100 - limit * 100 / want;
+        }
+        trace_migration_throttle_vcpu(idx, want, limit, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+
+    cpu_list_unlock();
+    rs->vcpu_throttled = true;
+}
+
 /**
  * mig_throttle_guest_down: throotle down the guest
  *
@@ -1537,12 +2240,45 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
     return next;
 }
 
+/*
+ * The accelerator's dirty log is cleared (and the pages write-protected
+ * again) in chunks of this many target pages, right before the first page
+ * of the chunk is sent, rather than when the log is synced.  Pages that
+ * the guest dirties between the sync and the send are then not faulted on
+ * twice, and the clear is spread over the iteration instead of stalling
+ * the vCPUs at every sync.
+ */
+#define RAM_CLEAR_BMAP_SHIFT  18
+
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
+                                                       unsigned long page)
+{
+    unsigned long chunk = page >> RAM_CLEAR_BMAP_SHIFT;
+    hwaddr start, size;
+
+    if (!rb->clear_bmap || !test_and_clear_bit(chunk, rb->clear_bmap)) {
+        return;
+    }
+
+    start = (hwaddr)chunk << (RAM_CLEAR_BMAP_SHIFT + TARGET_PAGE_BITS);
+    if (start >= rb->used_length) {
+        return;
+    }
+    size = MIN((hwaddr)1 << (RAM_CLEAR_BMAP_SHIFT + TARGET_PAGE_BITS),
+               rb->used_length - start);
+    trace_migration_bitmap_clear_dirty(rb->idstr, start, size, page);
+    memory_region_clear_dirty_bitmap(rb->mr, start, size);
+}
+
 static inline bool migration_bitmap_clear_dirty(RAMState *rs,
                                                 RAMBlock *rb,
                                                 unsigned long page)
 {
     bool ret;
 
+    /* Re-arm dirty tracking before the page is read for sending */
+    migration_clear_memory_region_dirty_bitmap(rb, page);
+
     ret = test_and_clear_bit(page, rb->bmap);
 
     if (ret) {
@@ -1554,9 +2290,16 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
 static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                         ram_addr_t start, ram_addr_t length)
 {
+    unsigned long first = start >> (RAM_CLEAR_BMAP_SHIFT + TARGET_PAGE_BITS);
+    unsigned long last = (start + length - 1) >>
+                         (RAM_CLEAR_BMAP_SHIFT + TARGET_PAGE_BITS);
+
     rs->migration_dirty_pages +=
         cpu_physical_memory_sync_dirty_bitmap(rb, start, length,
                                               &rs->num_dirty_pages_period);
+    if (rb->clear_bmap && length) {
+        bitmap_set(rb->clear_bmap, first, last - first + 1);
+    }
 }
 
 /**
@@ -1641,12 +2384,26 @@ static void migration_bitmap_sync(RAMState *rs)
                were in this routine. If that happens twice, start or increase
                throttling */
 
+            uint64_t bytes_xfer_period = bytes_xfer_now - rs->bytes_xfer_prev;
+            uint64_t vcpu_dirty = mig_vcpu_dirty_sample(rs);
+
             if ((rs->num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - rs->bytes_xfer_prev) / 2) &&
+                   bytes_xfer_period / 2) &&
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    /*
+                     * If we know which vCPUs dirty memory, only slow
+                     * down those; otherwise throttle all of them.
+                     */
+                    if (vcpu_dirty) {
+                        mig_throttle_vcpus(rs, vcpu_dirty, bytes_xfer_period);
+                    } else {
+                        mig_throttle_guest_down();
+                    }
+            } else if (vcpu_dirty && rs->vcpu_throttled) {
+                /* Follow the dirty rates, easing off where possible */
+                mig_throttle_vcpus(rs, vcpu_dirty, bytes_xfer_period);
             }
         }
 
@@ -1803,6 +2560,14 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         }
     }
 
+    /*
+     * With write tracking, the page becomes writable as soon as it has
+     * been saved; copy it rather than queueing a pointer to guest RAM.
+     */
+    if (rs->uffdio_fd >= 0) {
+        send_async = false;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         pages = save_normal_page(rs, block, offset, p, send_async);
@@ -1816,12 +2581,51 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
+    /* ram_counters are updated when the channel has sent the page */
     multifd_queue_page(block, offset);
-    ram_counters.normal++;
 
     return 1;
 }
 
+/**
+ * ram_save_mapped_page: write a page to its place in the file
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    struct iovec iov = {
+        .iov_base = block->host + offset,
+        .iov_len = TARGET_PAGE_SIZE,
+    };
+    Error *local_err = NULL;
+    int64_t written;
+
+    written = mapped_ram_write_pages(qemu_file_get_ioc(rs->f), block, &offset,
+                                     &iov, 1, &local_err);
+    if (written < 0) {
+        error_report_err(local_err);
+        qemu_file_set_error(rs->f, -EIO);
+        return -EIO;
+    }
+
+    if (written) {
+        ram_counters.normal++;
+        ram_counters.transferred += TARGET_PAGE_SIZE;
+        /* Keep the bandwidth estimate and the rate limit in line */
+        qemu_update_position(rs->f, TARGET_PAGE_SIZE);
+        qemu_file_acct_rate_limit(rs->f, TARGET_PAGE_SIZE);
+    } else {
+        ram_counters.duplicate++;
+    }
+    return 1;
+}
+
 static int do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                 ram_addr_t offset, uint8_t *source_buf)
 {
@@ -1977,15 +2781,18 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
  *
  * @rs: current RAM state
  * @offset: used to return the offset within the RAMBlock
+ * @prefetch: take the page from the prefetch queue
  */
-static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
+static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset,
+                              bool prefetch)
 {
     RAMBlock *block = NULL;
+    struct src_page_requests *queue = prefetch ? &rs->src_prefetch_requests :
+                                                 &rs->src_page_requests;
 
     qemu_mutex_lock(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-        struct RAMSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&rs->src_page_requests);
+    if (!QSIMPLEQ_EMPTY(queue)) {
+        struct RAMSrcPageRequest *entry = QSIMPLEQ_FIRST(queue);
         block = entry->rb;
         *offset = entry->offset;
 
@@ -1994,9 +2801,11 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+            QSIMPLEQ_REMOVE_HEAD(queue, next_req);
             g_free(entry);
-            migration_consume_urgent_request();
+            if (!prefetch) {
+                migration_consume_urgent_request();
+            }
         }
     }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
@@ -2004,6 +2813,40 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
     return block;
 }
 
+/**
+ * poll_fault_page: get a page the guest is waiting to write
+ *
+ * Returns the block of the page, or NULL if no vCPU or other thread is
+ * blocked on a write-protected page.
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    RAMBlock *block;
+    void *addr;
+
+    if (rs->uffdio_fd < 0) {
+        return NULL;
+    }
+
+    addr = uffd_wp_read_fault(rs->uffdio_fd);
+    if (!addr) {
+        return NULL;
+    }
+
+    block = qemu_ram_block_from_host(addr, false, offset);
+    if (!block) {
+        error_report("%s: write fault at %p outside guest RAM",
+                     __func__, addr);
+        return NULL;
+    }
+    *offset = QEMU_ALIGN_DOWN(*offset, qemu_ram_pagesize(block));
+    trace_poll_fault_page(block->idstr, *offset);
+    return block;
+}
+
 /**
  * get_queued_page: unqueue a page from the postocpy requests
  *
@@ -2013,15 +2856,20 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
  *
  * @rs: current RAM state
  * @pss: data about the state of the current dirty page scan
+ * @prefetch: look at the prefetch queue instead of the requested pages
  */
-static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
+static bool get_queued_page(RAMState *rs, PageSearchStatus *pss,
+                            bool prefetch)
 {
     RAMBlock  *block;
     ram_addr_t offset;
     bool dirty;
 
     do {
-        block = unqueue_page(rs, &offset);
+        block = unqueue_page(rs, &offset, prefetch);
+        if (!block && !prefetch) {
+            block = poll_fault_page(rs, &offset);
+        }
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -2035,7 +2883,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             dirty = test_bit(page, block->bmap);
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
-                       page, test_bit(page, block->unsentmap));
+                       page, block->unsentmap &&
+                             test_bit(page, block->unsentmap));
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -2084,6 +2933,12 @@ static void migration_page_queue_free(RAMState *rs)
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &rs->src_prefetch_requests, next_req,
+                          next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&rs->src_prefetch_requests, next_req);
+        g_free(mspr);
+    }
     rcu_read_unlock();
 }
 
@@ -2098,8 +2953,11 @@ static void migration_page_queue_free(RAMState *rs)
  *          same that last one.
  * @start: starting address from the start of the RAMBlock
  * @len: length (in bytes) to send
+ * @prefetch: the destination is not waiting for the pages yet, so they
+ *            are sent after the other requests, on the main channel
  */
-int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
+                         bool prefetch)
 {
     RAMBlock *ramblock;
     RAMState *rs = ram_state;
@@ -2144,8 +3002,12 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
 
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&rs->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
-    migration_make_urgent_request();
+    if (prefetch) {
+        QSIMPLEQ_INSERT_TAIL(&rs->src_prefetch_requests, new_entry, next_req);
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
+        migration_make_urgent_request();
+    }
     qemu_mutex_unlock(&rs->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -2205,6 +3067,15 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
             flush_compressed_data(rs);
     }
 
+    /* multifd channels look for zero pages themselves */
+    if (migrate_use_multifd() && !save_page_use_compression(rs)) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2258,6 +3129,7 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
 
     if (!qemu_ram_is_migratable(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
@@ -2285,6 +3157,18 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     } while ((pss->page & (pagesize_bits - 1)) &&
              offset_in_ramblock(pss->block, pss->page << TARGET_PAGE_BITS));
 
+    /* The saved pages can be written again */
+    if (rs->uffdio_fd >= 0 && !memory_region_is_rom(pss->block->mr)) {
+        int ret = uffd_wp_protect(rs->uffdio_fd,
+                                  pss->block->host +
+                                  (start_page << TARGET_PAGE_BITS),
+                                  (pss->page - start_page) << TARGET_PAGE_BITS,
+                                  false);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -2304,6 +3188,50 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
  * pages in a host page that are dirty.
  */
 
+static bool postcopy_preempt_active(void)
+{
+    return migration_in_postcopy() &&
+           migrate_get_current()->postcopy_qemufile_src;
+}
+
+/**
+ * ram_save_host_page_urgent: send a page the destination asked for
+ *
+ * The page goes on the postcopy preempt channel, so that it does not
+ * wait behind the background pages already queued on the main channel.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    QEMUFile *preempt = migrate_get_current()->postcopy_qemufile_src;
+    QEMUFile *main_f = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    rs->f = preempt;
+    rs->last_sent_block = rs->preempt_last_sent_block;
+    pages = ram_save_host_page(rs, pss, last_stage);
+    rs->preempt_last_sent_block = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_f;
+
+    /* Don't let it sit in the buffer */
+    qemu_fflush(preempt);
+    ret = qemu_file_get_error(preempt);
+    if (ret) {
+        /* The page may be lost, have the main channel handle it */
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+    return pages;
+}
+
 static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
@@ -2324,16 +3252,25 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     }
 
     do {
+        bool urgent;
+
         again = true;
-        found = get_queued_page(rs, &pss);
+        found = urgent = get_queued_page(rs, &pss, false);
 
+        if (!found) {
+            found = get_queued_page(rs, &pss, true);
+        }
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
         if (found) {
-            pages = ram_save_host_page(rs, &pss, last_stage);
+            if (urgent && postcopy_preempt_active()) {
+                pages = ram_save_host_page_urgent(rs, &pss, last_stage);
+            } else {
+                pages = ram_save_host_page(rs, &pss, last_stage);
+            }
         }
     } while (!pages && again);
 
@@ -2343,6 +3280,131 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     return pages;
 }
 
+/*
+ * Number of pages of a dirty bitmap handed to a multifd channel at a
+ * time.  It must be a multiple of BITS_PER_LONG.
+ */
+#define MULTIFD_SCAN_PAGES (64 * 1024)
+
+/**
+ * multifd_use_scan: whether the multifd channels look for dirty pages
+ *
+ * The channels send every page they find as it is, so this is only
+ * possible when no other feature needs to see each page.
+ */
+static bool multifd_use_scan(void)
+{
+    return migrate_use_multifd() && !migrate_use_compression() &&
+           !migrate_use_xbzrle() && !migrate_postcopy_ram() &&
+           !migrate_release_ram() && !migrate_background_snapshot();
+}
+
+static RAMBlock *multifd_scan_next_block(RAMState *rs, RAMBlock *block)
+{
+    do {
+        block = block ? QLIST_NEXT_RCU(block, next) : NULL;
+        if (!block) {
+            block = QLIST_FIRST_RCU(&ram_list.blocks);
+            rs->ram_bulk_stage = false;
+        }
+    } while (!qemu_ram_is_migratable(block));
+
+    return block;
+}
+
+/**
+ * multifd_scan_dirty: let the multifd channels find and send dirty pages
+ *
+ * Called within an RCU critical section.
+ *
+ * The dirty bitmaps are cut in slices of MULTIFD_SCAN_PAGES pages.  Each
+ * round hands the next slice to every channel, which clears and sends
+ * the dirty pages it finds there, and waits for all of them.  Rounds go
+ * on until some dirty pages were found or the whole RAM was scanned.
+ *
+ * Returns the number of pages sent, zero when no dirty page was found,
+ * or a negative value for error
+ *
+ * @rs: current RAM state
+ */
+static int multifd_scan_dirty(RAMState *rs)
+{
+    uint32_t page_count = multifd_send_state->pages->allocated;
+    uint64_t total = ram_bytes_total() >> TARGET_PAGE_BITS;
+    RAMBlock *block = rs->last_seen_block;
+    unsigned long page = QEMU_ALIGN_DOWN(rs->last_page, BITS_PER_LONG);
+    uint64_t scanned = 0;
+    int pages = 0;
+    int i, assigned;
+
+    /* No dirty page as there is zero RAM */
+    if (!total) {
+        return 0;
+    }
+
+    if (!block || !qemu_ram_is_migratable(block) ||
+        page >= (block->used_length >> TARGET_PAGE_BITS)) {
+        block = multifd_scan_next_block(rs, block);
+        page = 0;
+    }
+
+    while (!pages && scanned < total) {
+        for (assigned = 0; assigned < migrate_multifd_channels() &&
+                           scanned < total; assigned++) {
+            MultiFDSendParams *p = &multifd_send_state->params[assigned];
+            unsigned long size = block->used_length >> TARGET_PAGE_BITS;
+            unsigned long end = MIN(page + MULTIFD_SCAN_PAGES, size);
+
+            qemu_mutex_lock(&p->mutex);
+            if (!p->running) {
+                qemu_mutex_unlock(&p->mutex);
+                break;
+            }
+            p->scan_block = block;
+            p->scan_start = page;
+            p->scan_end = end;
+            p->scan_packet_num = multifd_send_state->packet_num;
+            multifd_send_state->packet_num += DIV_ROUND_UP(end - page,
+                                                           page_count);
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&p->sem);
+
+            scanned += end - page;
+            page = end;
+            if (page >= size) {
+                block = multifd_scan_next_block(rs, block);
+                page = 0;
+            }
+        }
+
+        for (i = 0; i < assigned; i++) {
+            qemu_sem_wait(&multifd_send_state->scan_done);
+        }
+        for (i = 0; i < assigned; i++) {
+            MultiFDSendParams *p = &multifd_send_state->params[i];
+
+            qemu_mutex_lock(&p->mutex);
+            pages += p->scan_pages;
+            p->scan_pages = 0;
+            qemu_mutex_unlock(&p->mutex);
+        }
+        if (assigned < migrate_multifd_channels() && scanned < total) {
+            /* A channel is gone, the error was already reported */
+            pages = -EIO;
+            break;
+        }
+    }
+
+    rs->last_seen_block = block;
+    rs->last_page = page;
+    if (pages > 0) {
+        rs->migration_dirty_pages -= pages;
+    }
+    multifd_send_account();
+
+    return pages;
+}
+
 void acct_update_position(QEMUFile *f, size_t size, bool zero)
 {
     uint64_t pages = size / TARGET_PAGE_SIZE;
@@ -2386,6 +3448,8 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_prev);
+        g_free((*rsp)->vcpu_dirty_period);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -2412,16 +3476,24 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    ram_write_tracking_stop();
+
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against this migration_bitmap
      */
-    memory_global_dirty_log_stop();
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->clear_bmap);
+        block->clear_bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2433,6 +3505,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -2764,6 +3837,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->preempt_last_sent_block = NULL;
     rs->last_page = 0;
 
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
@@ -2906,6 +3980,12 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    QSIMPLEQ_INIT(&(*rsp)->src_prefetch_requests);
+    (*rsp)->uffdio_fd = -1;
+    (*rsp)->vcpu_dirty_prev = g_new0(uint64_t, max_cpus);
+    (*rsp)->vcpu_dirty_period = g_new0(uint64_t, max_cpus);
+    /* Only count what the vCPUs dirty from now on */
+    mig_vcpu_dirty_sample(*rsp);
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2929,6 +4009,8 @@ static void ram_list_init_bitmaps(void)
             pages = block->max_length >> TARGET_PAGE_BITS;
             block->bmap = bitmap_new(pages);
             bitmap_set(block->bmap, 0, pages);
+            block->clear_bmap = bitmap_new(DIV_ROUND_UP(pages,
+                                               1UL << RAM_CLEAR_BMAP_SHIFT));
             if (migrate_postcopy_ram()) {
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
@@ -2945,8 +4027,14 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
-    migration_bitmap_sync(rs);
+    /*
+     * A background snapshot saves every page exactly once, write
+     * tracking takes care of keeping it consistent.
+     */
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_start();
+        migration_bitmap_sync(rs);
+    }
 
     rcu_read_unlock();
     qemu_mutex_unlock_ramlist();
@@ -2969,6 +4057,127 @@ static int ram_init_all(RAMState **rsp)
     return 0;
 }
 
+bool ram_write_tracking_available(void)
+{
+    return uffd_wp_supported_by_host();
+}
+
+/*
+ * Only private anonymous memory can be write-protected before it is
+ * populated: reading a hole there maps the shared zero page.  In shmem,
+ * memfd or hugetlbfs backed blocks the same read allocates the page, or
+ * with older kernels the registration fails.
+ */
+bool ram_write_tracking_compatible(Error **errp)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (memory_region_is_rom(block->mr)) {
+            continue;
+        }
+        if (block->fd >= 0 || qemu_ram_is_shared(block)) {
+            error_setg(errp, "Background snapshot requires anonymous, "
+                       "non-shared memory, but RAM block '%s' is not",
+                       block->idstr);
+            rcu_read_unlock();
+            return false;
+        }
+    }
+    rcu_read_unlock();
+    return true;
+}
+
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+
+    /*
+     * A page discarded by the balloon would be dropped from the write
+     * protection and its snapshot content lost, as with postcopy.
+     */
+    qemu_balloon_inhibit(true);
+    ram_state->balloon_inhibited = true;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        size_t pagesize = qemu_ram_pagesize(block);
+        ram_addr_t offset;
+
+        if (memory_region_is_rom(block->mr)) {
+            continue;
+        }
+        /*
+         * Write protection only sticks to pages that are mapped.  Reading
+         * the holes maps them to the zero page without allocating
+         * anything, because ram_write_tracking_compatible() only lets
+         * private anonymous memory through.
+         */
+        for (offset = 0; offset < block->used_length; offset += pagesize) {
+            (void)*(volatile uint8_t *)(block->host + offset);
+        }
+    }
+    rcu_read_unlock();
+}
+
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+    int ufd;
+
+    ufd = uffd_wp_open();
+    if (ufd < 0) {
+        return -1;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (memory_region_is_rom(block->mr)) {
+            continue;
+        }
+        if (uffd_wp_register(ufd, block->host, block->max_length) ||
+            uffd_wp_protect(ufd, block->host, block->used_length, true)) {
+            rcu_read_unlock();
+            /* Closing the userfaultfd drops the protection too */
+            close(ufd);
+            return -1;
+        }
+    }
+    rcu_read_unlock();
+
+    rs->uffdio_fd = ufd;
+    return 0;
+}
+
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (rs && rs->balloon_inhibited) {
+        qemu_balloon_inhibit(false);
+        rs->balloon_inhibited = false;
+    }
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (!memory_region_is_rom(block->mr)) {
+            /* Also wakes up anybody still waiting for a page */
+            uffd_wp_protect(rs->uffdio_fd, block->host, block->used_length,
+                            false);
+        }
+    }
+    rcu_read_unlock();
+
+    close(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+}
+
 static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 {
     RAMBlock *block;
@@ -2990,6 +4199,7 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->preempt_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     /*
@@ -3011,6 +4221,71 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
  * granularity of these critical sections.
  */
 
+/* Size in the file of the mapped-ram bitmap of @block */
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+    return BITS_TO_LONGS(pages) * sizeof(unsigned long);
+}
+
+/*
+ * Write the mapped-ram header of @block and move the stream past the
+ * room of its bitmap and pages
+ */
+static void mapped_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    /* version, page size, bitmap offset and pages offset */
+    const int64_t header_size = 4 + 8 + 8 + 8;
+    int64_t offset = qemu_get_offset(f);
+
+    if (offset < 0) {
+        qemu_file_set_error(f, offset);
+        return;
+    }
+
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    block->bitmap_offset = offset + header_size;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block),
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    qemu_set_offset(f, block->pages_offset + block->used_length, SEEK_SET);
+}
+
+/*
+ * Write the bitmaps of the pages present in the file, once all the
+ * pages are there
+ */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        size_t size = mapped_ram_bitmap_size(block);
+        unsigned long *le_bitmap = g_malloc(size);
+        struct iovec iov = { .iov_base = le_bitmap, .iov_len = size };
+        Error *local_err = NULL;
+
+        bitmap_to_le(le_bitmap, block->file_bmap,
+                     block->used_length >> TARGET_PAGE_BITS);
+        if (qio_channel_pwritev_all(ioc, &iov, 1, block->bitmap_offset,
+                                    &local_err) < 0) {
+            error_report_err(local_err);
+            qemu_file_set_error(f, -EIO);
+            g_free(le_bitmap);
+            return;
+        }
+        g_free(le_bitmap);
+    }
+}
+
 /**
  * ram_save_setup: Setup RAM for migration
  *
@@ -3048,6 +4323,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_postcopy_ram() && block->page_size != qemu_host_page_size) {
             qemu_put_be64(f, block->page_size);
         }
+        if (migrate_mapped_ram()) {
+            mapped_ram_setup_block(f, block);
+        }
     }
 
     rcu_read_unlock();
@@ -3056,6 +4334,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
     multifd_send_sync_main();
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3106,12 +4385,20 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
             break;
         }
 
-        pages = ram_find_and_save_block(rs, false);
+        if (multifd_use_scan()) {
+            pages = multifd_scan_dirty(rs);
+        } else {
+            pages = ram_find_and_save_block(rs, false);
+        }
         /* no more pages to sent */
         if (pages == 0) {
             done = 1;
             break;
         }
+        if (pages < 0) {
+            qemu_file_set_error(f, pages);
+            break;
+        }
         rs->iterations++;
 
         /* we want to check in the 1st loop, just in case it was the 1st time
@@ -3168,7 +4455,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_lock();
 
-    if (!migration_in_postcopy()) {
+    if (!migration_in_postcopy() && !migrate_background_snapshot()) {
         migration_bitmap_sync(rs);
     }
 
@@ -3180,11 +4467,19 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     while (true) {
         int pages;
 
-        pages = ram_find_and_save_block(rs, !migration_in_colo_state());
+        if (multifd_use_scan()) {
+            pages = multifd_scan_dirty(rs);
+        } else {
+            pages = ram_find_and_save_block(rs, !migration_in_colo_state());
+        }
         /* no more blocks to sent */
         if (pages == 0) {
             break;
         }
+        if (pages < 0) {
+            qemu_file_set_error(f, pages);
+            break;
+        }
     }
 
     flush_compressed_data(rs);
@@ -3193,6 +4488,21 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     rcu_read_unlock();
 
     multifd_send_sync_main();
+
+    if (migrate_mapped_ram()) {
+        rcu_read_lock();
+        mapped_ram_save_bitmaps(f);
+        rcu_read_unlock();
+    }
+
+    if (postcopy_preempt_active()) {
+        /* All pages are out, let the destination's preempt thread exit */
+        QEMUFile *preempt = migrate_get_current()->postcopy_qemufile_src;
+
+        qemu_put_be64(preempt, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(preempt);
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3210,7 +4520,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
-    if (!migration_in_postcopy() &&
+    if (!migration_in_postcopy() && !migrate_background_snapshot() &&
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
@@ -3271,26 +4581,29 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: RAM_CHANNEL_* that @f is, each has its own previous block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    static RAMBlock *blocks[RAM_CHANNEL_MAX];
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!blocks[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return blocks[channel];
     }
 
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    block = qemu_ram_block_by_name(id);
+    block = blocks[channel] = qemu_ram_block_by_name(id);
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -3539,13 +4852,12 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
 
 static int ram_load_cleanup(void *opaque)
 {
-    RAMBlock *rb;
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
 
-    RAMBLOCK_FOREACH_MIGRATABLE(rb) {
-        g_free(rb->receivedmap);
-        rb->receivedmap = NULL;
+    /* With multifd, the receive threads may still be running */
+    if (!multifd_recv_state) {
+        ramblock_recv_map_free();
     }
     return 0;
 }
@@ -3576,14 +4888,14 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * @f: QEMUFile where to send the data
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -3612,7 +4924,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3686,7 +4998,9 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: %#x"
@@ -3729,6 +5043,153 @@ static bool postcopy_is_running(void)
     return ps >= POSTCOPY_INCOMING_LISTENING && ps < POSTCOPY_INCOMING_END;
 }
 
+typedef struct {
+    QemuThread thread;
+    QIOChannel *ioc;
+    RAMBlock *block;
+    /* pages present in the file */
+    unsigned long *bitmap;
+    /* pages [start, end) of the block are loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    uint64_t pages_offset;
+    Error *err;
+} MappedRamLoadParams;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoadParams *p = opaque;
+    unsigned long page = find_next_bit(p->bitmap, p->end, p->start);
+
+    while (page < p->end) {
+        unsigned long last = find_next_zero_bit(p->bitmap, p->end, page);
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+        struct iovec iov = {
+            .iov_base = p->block->host + offset,
+            .iov_len = (last - page) << TARGET_PAGE_BITS,
+        };
+
+        if (qio_channel_preadv_all(p->ioc, &iov, 1, p->pages_offset + offset,
+                                   &p->err) < 0) {
+            break;
+        }
+        page = find_next_bit(p->bitmap, p->end, last);
+    }
+    return NULL;
+}
+
+/*
+ * Read the pages of @block present in the file; with x-multifd the
+ * block is split among as many threads as there are channels.  The
+ * pages that are not in the file are zero and the RAM already is.
+ */
+static int mapped_ram_load_pages(QIOChannel *ioc, RAMBlock *block,
+                                 unsigned long *bitmap, uint64_t pages_offset)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    int thread_count = migrate_use_multifd() ? migrate_multifd_channels() : 1;
+    unsigned long slice;
+    MappedRamLoadParams *params;
+    int i, ret = 0;
+
+    /* Slices start on a bitmap word, as for the multifd scan */
+    slice = ROUND_UP(DIV_ROUND_UP(pages, thread_count), BITS_PER_LONG);
+    params = g_new0(MappedRamLoadParams, thread_count);
+
+    for (i = 0; i < thread_count; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        p->ioc = ioc;
+        p->block = block;
+        p->bitmap = bitmap;
+        p->start = MIN(pages, i * slice);
+        p->end = MIN(pages, p->start + slice);
+        p->pages_offset = pages_offset;
+        if (thread_count > 1) {
+            qemu_thread_create(&p->thread, "mapped-ram-load",
+                               mapped_ram_load_thread, p,
+                               QEMU_THREAD_JOINABLE);
+        } else {
+            mapped_ram_load_thread(p);
+        }
+    }
+
+    for (i = 0; i < thread_count; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        if (thread_count > 1) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->err) {
+            if (!ret) {
+                error_report_err(p->err);
+            } else {
+                error_free(p->err);
+            }
+            ret = -EIO;
+        }
+    }
+
+    g_free(params);
+    return ret;
+}
+
+/*
+ * Read the mapped-ram header of @block, load the pages present in the
+ * file and move the stream past them
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    uint32_t version = qemu_get_be32(f);
+    uint64_t page_size = qemu_get_be64(f);
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t size = BITS_TO_LONGS(pages) * sizeof(unsigned long);
+    unsigned long *le_bitmap, *bitmap;
+    struct iovec iov;
+    Error *local_err = NULL;
+    int ret;
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram version %" PRIu32
+                     " for block %s", version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %s "
+                     "(local) %d != %" PRIu64, block->idstr,
+                     TARGET_PAGE_SIZE, page_size);
+        return -EINVAL;
+    }
+    if (!ioc) {
+        error_report("Mapped RAM needs a file transport");
+        return -EINVAL;
+    }
+
+    le_bitmap = g_malloc(size);
+    iov.iov_base = le_bitmap;
+    iov.iov_len = size;
+    if (qio_channel_preadv_all(ioc, &iov, 1, bitmap_offset, &local_err) < 0) {
+        error_report_err(local_err);
+        g_free(le_bitmap);
+        return -EIO;
+    }
+    bitmap = bitmap_new(pages);
+    bitmap_from_le(bitmap, le_bitmap, pages);
+    g_free(le_bitmap);
+
+    ret = mapped_ram_load_pages(ioc, block, bitmap, pages_offset);
+    g_free(bitmap);
+    if (ret) {
+        return ret;
+    }
+
+    qemu_set_offset(f, pages_offset + block->used_length, SEEK_SET);
+    return qemu_file_get_error(f);
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0, invalid_flags = 0;
@@ -3759,7 +5220,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -3782,7 +5243,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3834,6 +5296,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_block(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
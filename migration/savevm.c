@@ -743,6 +743,8 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
             QTAILQ_REMOVE(&savevm_state.handlers, se, entry);
             g_free(se->compat);
             g_free(se);
+            /* Rebuilt when another instance is saved or loaded */
+            vmstate_drop_plan(vmsd);
         }
     }
 }
@@ -1164,24 +1166,15 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
-                                       bool inactivate_disks)
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
-    bool in_postcopy = migration_in_postcopy();
-
-    trace_savevm_state_complete_precopy();
-
-    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops ||
             (in_postcopy && se->ops->has_postcopy &&
              se->ops->has_postcopy(se->opaque)) ||
-            (in_postcopy && !iterable_only) ||
             !se->ops->save_live_complete_precopy) {
             continue;
         }
@@ -1204,13 +1197,25 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         }
     }
 
-    if (iterable_only) {
-        return 0;
-    }
+    return 0;
+}
+
+int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
+                                                    bool in_postcopy,
+                                                    bool inactivate_disks)
+{
+    QJSON *vmdesc = NULL;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int ret;
 
-    vmdesc = qjson_new();
-    json_prop_int(vmdesc, "page_size", qemu_target_page_size());
-    json_start_array(vmdesc, "devices");
+    /* Only describe the devices when the description is sent */
+    if (should_send_vmdesc()) {
+        vmdesc = qjson_new();
+        json_prop_int(vmdesc, "page_size", qemu_target_page_size());
+        json_start_array(vmdesc, "devices");
+    }
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -1223,9 +1228,11 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
 
         trace_savevm_section_start(se->idstr, se->section_id);
 
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
+        if (vmdesc) {
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+        }
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         ret = vmstate_save(f, se, vmdesc);
@@ -1236,8 +1243,12 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
-        json_end_object(vmdesc);
+        if (vmdesc) {
+            json_end_object(vmdesc);
+        }
     }
+    trace_savevm_state_complete_precopy_devices(
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time, !!vmdesc);
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1255,21 +1266,43 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         qemu_put_byte(f, QEMU_VM_EOF);
     }
 
-    json_end_array(vmdesc);
-    qjson_finish(vmdesc);
-    vmdesc_len = strlen(qjson_get_str(vmdesc));
+    if (vmdesc) {
+        json_end_array(vmdesc);
+        qjson_finish(vmdesc);
+        vmdesc_len = strlen(qjson_get_str(vmdesc));
 
-    if (should_send_vmdesc()) {
         qemu_put_byte(f, QEMU_VM_VMDESCRIPTION);
         qemu_put_be32(f, vmdesc_len);
         qemu_put_buffer(f, (uint8_t *)qjson_get_str(vmdesc), vmdesc_len);
+        qjson_destroy(vmdesc);
     }
-    qjson_destroy(vmdesc);
 
     qemu_fflush(f);
     return 0;
 }
 
+int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
+                                       bool inactivate_disks)
+{
+    int ret;
+    bool in_postcopy = migration_in_postcopy();
+
+    trace_savevm_state_complete_precopy();
+
+    cpu_synchronize_all_states();
+
+    /* Once in postcopy, the iterable devices complete in postcopy */
+    if (!in_postcopy || iterable_only) {
+        ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
+        if (ret || iterable_only) {
+            return ret;
+        }
+    }
+
+    return qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
+                                                           inactivate_disks);
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -1709,6 +1742,10 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
         if (postcopy_ram_enable_notify(mis)) {
             return -1;
         }
+        /* Requested pages may now arrive on the preempt channel too */
+        if (migrate_postcopy_preempt()) {
+            postcopy_preempt_thread_start(mis);
+        }
     }
 
     if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, &local_err)) {
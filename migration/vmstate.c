@@ -18,6 +18,7 @@
 #include "qemu-file.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "trace.h"
 #include "qjson.h"
 
@@ -64,6 +65,111 @@ static int vmstate_size(void *opaque, VMStateField *field)
     return size;
 }
 
+/*
+ * Save/load plans
+ *
+ * uint8, int8 and buffer fields are in the stream just as they are in
+ * memory, so consecutive ones that also sit at contiguous offsets of
+ * the state are merged into a run, moved with a single
+ * qemu_put_buffer()/qemu_get_buffer() instead of one call per element.
+ * The plan of a description has one VMStateRun per field, only the
+ * first field of each run has it filled.  Plans are built the first
+ * time a description is used and looked up by its address.  They are
+ * dropped by vmstate_unregister(), so that a description that is freed
+ * afterwards cannot leave a stale plan for another one allocated at the
+ * same address.  Descriptions only reached through another one, e.g. by
+ * VMSTATE_STRUCT or as subsections, are dropped along with it.
+ */
+typedef struct VMStateRun {
+    /* number of fields in the run, 0 if no run starts at this field */
+    int nfields;
+    size_t offset;
+    size_t size;
+    /* the run is only valid from the highest version of its fields */
+    int version_id;
+} VMStateRun;
+
+static GHashTable *vmstate_plans;
+static QemuSpin vmstate_plans_lock;
+
+static bool vmstate_field_is_bytes(VMStateField *field)
+{
+    return !field->field_exists &&
+           !(field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER)) &&
+           (field->info == &vmstate_info_uint8 ||
+            field->info == &vmstate_info_int8 ||
+            field->info == &vmstate_info_buffer);
+}
+
+static VMStateRun *vmstate_build_plan(const VMStateDescription *vmsd)
+{
+    VMStateField *field;
+    VMStateRun *plan, *run = NULL;
+    int nfields = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        nfields++;
+    }
+
+    plan = g_new0(VMStateRun, nfields + 1);
+    for (field = vmsd->fields; field->name; field++) {
+        int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+
+        if (!vmstate_field_is_bytes(field)) {
+            run = NULL;
+            continue;
+        }
+        if (!run || run->offset + run->size != field->offset) {
+            run = &plan[field - vmsd->fields];
+            run->offset = field->offset;
+        }
+        run->nfields++;
+        run->size += field->size * n_elems;
+        run->version_id = MAX(run->version_id, field->version_id);
+    }
+    return plan;
+}
+
+static const VMStateRun *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStateRun *plan;
+
+    qemu_spin_lock(&vmstate_plans_lock);
+    if (!vmstate_plans) {
+        vmstate_plans = g_hash_table_new(NULL, NULL);
+    }
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (!plan) {
+        plan = vmstate_build_plan(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    }
+    qemu_spin_unlock(&vmstate_plans_lock);
+
+    return plan;
+}
+
+void vmstate_drop_plan(const VMStateDescription *vmsd)
+{
+    const VMStateDescription **sub;
+    VMStateField *field;
+
+    qemu_spin_lock(&vmstate_plans_lock);
+    if (vmstate_plans) {
+        g_free(g_hash_table_lookup(vmstate_plans, vmsd));
+        g_hash_table_remove(vmstate_plans, vmsd);
+    }
+    qemu_spin_unlock(&vmstate_plans_lock);
+
+    for (field = vmsd->fields; field && field->name; field++) {
+        if (field->vmsd) {
+            vmstate_drop_plan(field->vmsd);
+        }
+    }
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        vmstate_drop_plan(*sub);
+    }
+}
+
 static void vmstate_handle_alloc(void *ptr, VMStateField *field, void *opaque)
 {
     if (field->flags & VMS_POINTER && field->flags & VMS_ALLOC) {
@@ -79,6 +185,7 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     VMStateField *field = vmsd->fields;
+    const VMStateRun *plan;
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -108,7 +215,25 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
+    plan = vmstate_get_plan(vmsd);
     while (field->name) {
+        const VMStateRun *run = &plan[field - vmsd->fields];
+
+        if (run->nfields && run->version_id <= version_id) {
+            trace_vmstate_load_state_run(vmsd->name, field->name,
+                                         run->nfields, run->size);
+            qemu_get_buffer(f, opaque + run->offset, run->size);
+            ret = qemu_file_get_error(f);
+            if (ret < 0) {
+                error_report("Failed to load %s:%s", vmsd->name,
+                             field->name);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+            field += run->nfields;
+            continue;
+        }
+
         trace_vmstate_load_state_field(vmsd->name, field->name);
         if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
@@ -303,6 +428,31 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd, QJSON *vmdesc,
 }
 
 
+static void vmstate_save_run(QEMUFile *f, const VMStateDescription *vmsd,
+                             VMStateField *field, const VMStateRun *run,
+                             void *opaque, QJSON *vmdesc)
+{
+    int i;
+
+    trace_vmstate_save_state_run(vmsd->name, field->name, run->nfields,
+                                 run->size);
+    qemu_put_buffer(f, opaque + run->offset, run->size);
+
+    if (!vmdesc) {
+        return;
+    }
+    /* Describe the fields as the loop in vmstate_save_state_v() does */
+    for (i = 0; i < run->nfields; i++) {
+        int n_elems = field[i].flags & VMS_ARRAY ? field[i].num : 1;
+
+        if (!n_elems) {
+            continue;
+        }
+        vmsd_desc_field_start(vmsd, vmdesc, &field[i], 0, n_elems);
+        vmsd_desc_field_end(vmsd, vmdesc, &field[i], field[i].size, 0);
+    }
+}
+
 bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 {
     if (vmsd->needed && !vmsd->needed(opaque)) {
@@ -324,6 +474,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
 {
     int ret = 0;
     VMStateField *field = vmsd->fields;
+    const VMStateRun *plan;
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -342,7 +493,16 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
         json_start_array(vmdesc, "fields");
     }
 
+    plan = vmstate_get_plan(vmsd);
     while (field->name) {
+        const VMStateRun *run = &plan[field - vmsd->fields];
+
+        if (run->nfields && run->version_id <= version_id) {
+            vmstate_save_run(f, vmsd, field, run, opaque, vmdesc);
+            field += run->nfields;
+            continue;
+        }
+
         if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
             (!field->field_exists &&
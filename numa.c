@@ -346,6 +346,27 @@ void numa_default_auto_assign_ram(MachineClass *mc, NodeInfo *nodes,
     nodes[i].node_mem = size - usedmem;
 }
 
+static int numa_iothread_set_affinity_one(Object *obj, void *opaque)
+{
+    IOThread *iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+
+    if (iothread) {
+        numa_iothread_set_affinity(iothread);
+    }
+    return 0;
+}
+
+/* I/O threads are created before the machine and its NUMA nodes */
+static void numa_iothreads_set_affinity(Notifier *notifier, void *data)
+{
+    object_child_foreach(object_get_objects_root(),
+                         numa_iothread_set_affinity_one, NULL);
+}
+
+static Notifier numa_iothreads_notifier = {
+    .notify = numa_iothreads_set_affinity,
+};
+
 void numa_complete_configuration(MachineState *ms)
 {
     int i;
@@ -434,6 +455,10 @@ void numa_complete_configuration(MachineState *ms)
             /* Validation succeeded, now fill in any missing distances. */
             complete_init_numa_distance();
         }
+
+        if (ms->numa_affinity) {
+            qemu_add_machine_init_done_notifier(&numa_iothreads_notifier);
+        }
     }
 }
 
@@ -455,6 +480,62 @@ void qmp_set_numa_node(NumaOptions *cmd, Error **errp)
     set_numa_options(MACHINE(qdev_get_machine()), cmd, errp);
 }
 
+/* Run @thread on the host CPUs local to the memory of guest node @nodenr */
+static void numa_set_thread_affinity(QemuThread *thread, int64_t nodenr,
+                                     const char *what)
+{
+    HostMemoryBackend *backend;
+    unsigned long *cpus;
+    unsigned long nbits;
+    int ret;
+
+    if (nodenr < 0 || nodenr >= nb_numa_nodes) {
+        return;
+    }
+    backend = numa_info[nodenr].node_memdev;
+    if (!backend) {
+        return;
+    }
+    cpus = host_memory_backend_get_host_cpus(backend, &nbits);
+    if (!cpus) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(thread, cpus, nbits);
+    if (ret < 0) {
+        warn_report("cannot pin %s to the host CPUs of NUMA node %" PRId64
+                    ": %s", what, nodenr, strerror(-ret));
+    }
+    g_free(cpus);
+}
+
+void numa_cpu_set_affinity(CPUState *cpu)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    MachineClass *mc = MACHINE_GET_CLASS(ms);
+    CpuInstanceProperties props;
+
+    if (!ms->numa_affinity || !nb_numa_nodes ||
+        !mc->cpu_index_to_instance_props) {
+        return;
+    }
+
+    props = mc->cpu_index_to_instance_props(ms, cpu->cpu_index);
+    if (props.has_node_id) {
+        numa_set_thread_affinity(cpu->thread, props.node_id, "vCPU thread");
+    }
+}
+
+void numa_iothread_set_affinity(IOThread *iothread)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+
+    if (ms->numa_affinity && iothread->numa_node >= 0) {
+        numa_set_thread_affinity(&iothread->thread, iothread->numa_node,
+                                 "I/O thread");
+    }
+}
+
 void numa_cpu_pre_plug(const CPUArchId *slot, DeviceState *dev, Error **errp)
 {
     int node_id = object_property_get_int(OBJECT(dev), "node-id", &error_abort);
@@ -617,6 +698,11 @@ static int query_memdev(Object *obj, void *opaque)
         object_property_get_uint16List(obj, "host-nodes",
                                        &m->value->host_nodes,
                                        &error_abort);
+        if (m->value->prealloc) {
+            m->value->has_prealloc_populated = true;
+            m->value->prealloc_populated =
+                host_memory_backend_prealloc_populated(MEMORY_BACKEND(obj));
+        }
 
         m->next = *list;
         *list = m;
@@ -37,6 +37,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                numa-affinity=on|off runs vCPU and I/O threads on the host nodes of their guest NUMA node (default=off)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
     "                aes-key-wrap=on|off controls support for AES key wrapping (default=on)\n"
     "                dea-key-wrap=on|off controls support for DEA key wrapping (default=on)\n"
@@ -86,6 +87,14 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item numa-affinity=on|off
+Restricts each vCPU thread, and each I/O thread with a @option{numa-node}
+property, to the host CPUs of the host NUMA nodes that the memory backend
+of its guest NUMA node is bound to (see @option{host-nodes} and
+@option{policy} of @option{memory-backend-ram}).  Guest nodes without such
+a backend are left alone.  Preallocation of backends with the "bind" or
+"preferred" policy also runs on the host CPUs of their nodes.  The default
+is off.
 @item aes-key-wrap=on|off
 Enables or disables AES key wrapping support on s390-ccw hosts. This feature
 controls whether AES wrapping keys will be created to allow
@@ -128,9 +137,13 @@ Select CPU model (@code{-cpu help} for list and additional feature selection)
 ETEXI
 
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
-    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "-accel [accel=]accelerator[,thread=single|multi][,perfmap=on|off]\n"
+    "                [,jitdump=on|off][,dirty-ring-size=n]\n"
     "                select accelerator (kvm, xen, hax, hvf, whpx or tcg; use 'help' for a list)\n"
-    "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                perfmap=on|off (write a perf map of TCG generated code)\n"
+    "                jitdump=on|off (write a perf jitdump of TCG generated code)\n"
+    "                dirty-ring-size=n (use KVM dirty rings of n entries per vCPU)\n", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
 @findex -accel
@@ -144,6 +157,24 @@ Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
 is to enable multi-threading where both the back-end and front-ends support it and
 no incompatible TCG features have been enabled (e.g. icount/replay).
+@item perfmap=on|off
+Write the host address, size and guest PC of every translated block to
+@file{/tmp/perf-<pid>.map}, so that @command{perf top} and @command{perf report}
+can attribute time spent in generated code to guest code.  The map is
+emptied when the translation cache is flushed.  Off by default, and only
+available on Linux hosts.
+@item jitdump=on|off
+Write the code and guest PC of every translated block to
+@file{/tmp/jit-<pid>.dump}.  Record with @command{perf record -k 1} and run
+@command{perf inject --jit} on the result before @command{perf report}.
+Unlike the perf map, this stays accurate across translation cache flushes.
+Off by default, and only available on Linux hosts.
+@item dirty-ring-size=@var{n}
+When using KVM, track dirty guest pages with per-vCPU rings of @var{n}
+entries instead of per-memslot dirty bitmaps.  @var{n} must be a power of
+two.  Dirty pages are then harvested incrementally, so that the cost of
+a dirty log sync depends on the number of pages written by the guest rather
+than on the size of guest memory.  The default of 0 keeps the bitmap.
 @end table
 ETEXI
 
@@ -3740,6 +3771,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3758,6 +3791,10 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Accept incoming migration from a given file, as written by migrate to a
+file: URI.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -4002,7 +4039,7 @@ property must be set.  These objects are placed in the
 
 @table @option
 
-@item -object memory-backend-file,id=@var{id},size=@var{size},mem-path=@var{dir},share=@var{on|off},discard-data=@var{on|off},merge=@var{on|off},dump=@var{on|off},prealloc=@var{on|off},host-nodes=@var{host-nodes},policy=@var{default|preferred|bind|interleave},align=@var{align}
+@item -object memory-backend-file,id=@var{id},size=@var{size},mem-path=@var{dir},share=@var{on|off},discard-data=@var{on|off},merge=@var{on|off},dump=@var{on|off},prealloc=@var{on|off},prealloc-threads=@var{threads},host-nodes=@var{host-nodes},policy=@var{default|preferred|bind|interleave},align=@var{align}
 
 Creates a memory file backend object, which can be used to back
 the guest RAM with huge pages.
@@ -4043,6 +4080,14 @@ Setting the @option{dump} boolean option to @var{off} excludes the memory from
 core dumps. This feature is also known as MADV_DONTDUMP.
 
 The @option{prealloc} boolean option enables memory preallocation.
+When the host supports MADV_POPULATE_WRITE, memory of backends created on
+the command line is preallocated in the background while the rest of the
+command line is processed, and the machine is only built once it is
+complete; with @option{--preconfig}, the progress is reported by the
+@code{query-memdev} QMP command.  The
+@option{prealloc-threads} option limits the number of preallocation
+threads; the default, 0, uses one thread per host CPU local to
+@option{host-nodes}.
 
 The @option{host-nodes} option binds the memory range to a list of NUMA host
 nodes.
@@ -14,3 +14,8 @@ void qemu_mutex_lock_iothread(void)
 void qemu_mutex_unlock_iothread(void)
 {
 }
+
+uint64_t qemu_mutex_iothread_contended(void)
+{
+    return 0;
+}
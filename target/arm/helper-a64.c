@@ -30,6 +30,7 @@
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "qemu/int128.h"
+#include "qemu/atomic128.h"
 #include "tcg.h"
 #include "fpu/softfloat.h"
 #include <zlib.h> /* For crc32 */
@@ -521,7 +522,7 @@ static uint64_t do_paired_cmpxchg64_le(CPUARMState *env, uint64_t addr,
     newv = int128_make128(new_lo, new_hi);
 
     if (parallel) {
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
         cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
         int mem_idx = cpu_mmu_index(env, false);
@@ -593,7 +594,7 @@ static uint64_t do_paired_cmpxchg64_be(CPUARMState *env, uint64_t addr,
     newv = int128_make128(new_hi, new_lo);
 
     if (parallel) {
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
         cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
         int mem_idx = cpu_mmu_index(env, false);
@@ -656,7 +657,7 @@ void HELPER(casp_le_parallel)(CPUARMState *env, uint32_t rs, uint64_t addr,
                               uint64_t new_lo, uint64_t new_hi)
 {
     uintptr_t ra = GETPC();
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
     cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
     Int128 oldv, cmpv, newv;
@@ -677,7 +678,7 @@ void HELPER(casp_be_parallel)(CPUARMState *env, uint32_t rs, uint64_t addr,
                               uint64_t new_hi, uint64_t new_lo)
 {
     uintptr_t ra = GETPC();
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
     cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
     Int128 oldv, cmpv, newv;
@@ -25,6 +25,7 @@
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "qemu/int128.h"
+#include "qemu/atomic128.h"
 
 #if !defined(CONFIG_USER_ONLY)
 #include "hw/s390x/storage-keys.h"
@@ -1375,7 +1376,7 @@ static void do_cdsg(CPUS390XState *env, uint64_t addr,
     bool fail;
 
     if (parallel) {
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
         cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
         int mem_idx = cpu_mmu_index(env, false);
@@ -1421,7 +1422,7 @@ void HELPER(cdsg_parallel)(CPUS390XState *env, uint64_t addr,
 static uint32_t do_csst(CPUS390XState *env, uint32_t r3, uint64_t a1,
                         uint64_t a2, bool parallel)
 {
-#if !defined(CONFIG_USER_ONLY) || defined(CONFIG_ATOMIC128)
+#if !defined(CONFIG_USER_ONLY) || defined(HAVE_ATOMIC128)
     uint32_t mem_idx = cpu_mmu_index(env, false);
 #endif
     uintptr_t ra = GETPC();
@@ -1459,8 +1460,10 @@ static uint32_t do_csst(CPUS390XState *env, uint32_t r3, uint64_t a1,
         int mask = 0;
 #if !defined(CONFIG_ATOMIC64)
         mask = -8;
-#elif !defined(CONFIG_ATOMIC128)
+#elif !defined(HAVE_ATOMIC128)
         mask = -16;
+#else
+        mask = atomic16_supported() ? 0 : -16;
 #endif
         if (((4 << fc) | (1 << sc)) & mask) {
             cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
@@ -1533,7 +1536,7 @@ static uint32_t do_csst(CPUS390XState *env, uint32_t r3, uint64_t a1,
             Int128 ov;
 
             if (parallel) {
-#ifdef CONFIG_ATOMIC128
+#ifdef HAVE_ATOMIC128
                 TCGMemOpIdx oi = make_memop_idx(MO_TEQ | MO_ALIGN_16, mem_idx);
                 ov = helper_atomic_cmpxchgo_be_mmu(env, a1, cv, nv, oi, ra);
                 cc = !int128_eq(ov, cv);
@@ -1583,7 +1586,7 @@ static uint32_t do_csst(CPUS390XState *env, uint32_t r3, uint64_t a1,
             break;
         case 4:
             if (parallel) {
-#ifdef CONFIG_ATOMIC128
+#ifdef HAVE_ATOMIC128
                 TCGMemOpIdx oi = make_memop_idx(MO_TEQ | MO_ALIGN_16, mem_idx);
                 Int128 sv = int128_make128(svl, svh);
                 helper_atomic_sto_be_mmu(env, a2, sv, oi, ra);
@@ -2092,7 +2095,7 @@ static uint64_t do_lpq(CPUS390XState *env, uint64_t addr, bool parallel)
     uint64_t hi, lo;
 
     if (parallel) {
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
         cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
         int mem_idx = cpu_mmu_index(env, false);
@@ -2129,7 +2132,7 @@ static void do_stpq(CPUS390XState *env, uint64_t addr,
     uintptr_t ra = GETPC();
 
     if (parallel) {
-#ifndef CONFIG_ATOMIC128
+#ifndef HAVE_ATOMIC128
         cpu_loop_exit_atomic(ENV_GET_CPU(env), ra);
 #else
         int mem_idx = cpu_mmu_index(env, false);
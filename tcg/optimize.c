@@ -594,6 +594,7 @@ void tcg_optimize(TCGContext *s)
     TCGOp *op, *op_next, *prev_mb = NULL;
     struct tcg_temp_info *infos;
     TCGTempSet temps_used;
+    TCGBar mb_done = 0;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -1464,6 +1465,43 @@ void tcg_optimize(TCGContext *s)
             break;
         }
 
+        /* Drop the orderings that an earlier barrier in this block
+         * already provides.  An X_Y ordering stays satisfied until
+         * the next access of kind X, so e.g. in
+         *   mb st_st; st; mb ld_ld|st_st
+         * the second barrier only needs to keep st_st.
+         */
+        if (opc == INDEX_op_mb) {
+            TCGBar need = op->args[0] & TCG_MO_ALL & ~mb_done;
+
+            mb_done |= op->args[0] & TCG_MO_ALL;
+            if (!prev_mb) {
+                if (need == 0) {
+                    tcg_op_remove(s, op);
+                    continue;
+                }
+                op->args[0] = (op->args[0] & ~TCG_MO_ALL) | need;
+            }
+        }
+        switch (opc) {
+        case INDEX_op_qemu_ld_i32:
+        case INDEX_op_qemu_ld_i64:
+            mb_done &= ~(TCG_MO_LD_LD | TCG_MO_LD_ST);
+            break;
+        case INDEX_op_qemu_st_i32:
+        case INDEX_op_qemu_st_i64:
+            mb_done &= ~(TCG_MO_ST_LD | TCG_MO_ST_ST);
+            break;
+        case INDEX_op_call:
+            mb_done = 0;
+            break;
+        default:
+            if (def->flags & TCG_OPF_BB_END) {
+                mb_done = 0;
+            }
+            break;
+        }
+
         /* Eliminate duplicate and redundant fence instructions.  */
         if (prev_mb) {
             switch (opc) {
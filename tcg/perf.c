@@ -0,0 +1,233 @@
+/*
+ * Linux perf support for TCG generated code.
+ *
+ * Two formats are supported.  The perf map, /tmp/perf-<pid>.map, holds
+ * one "START SIZE NAME" line per translated block and is read as is by
+ * "perf top" and "perf report".  It has no notion of time, so it is
+ * emptied whenever the code buffer is flushed.
+ *
+ * The jitdump, /tmp/jit-<pid>.dump, holds a timestamped copy of the code
+ * of each block.  "perf inject --jit" turns it into ELF images, which
+ * keeps samples correct even after the code buffer has been reused.
+ * Record with "perf record -k 1" so that perf uses the same clock.
+ *
+ * In both cases the name is the guest symbol covering the block, if
+ * any, followed by the guest PC.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "disas/disas.h"
+#include "tcg/perf.h"
+
+static FILE *perfmap;
+static FILE *jitdump;
+static void *jitdump_marker;
+static size_t jitdump_marker_size;
+static uint64_t jitdump_code_index;
+
+#define JITHEADER_MAGIC     0x4A695444
+#define JITHEADER_VERSION   1
+#define JIT_CODE_LOAD       0
+
+struct jitheader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jr_prefix {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jr_code_load {
+    struct jr_prefix p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+static uint64_t perf_timestamp(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* e_machine sits at the same offset in 32-bit and 64-bit ELF headers */
+static uint16_t perf_host_elf_machine(void)
+{
+    uint16_t machine = 0;
+    int fd;
+
+    fd = open("/proc/self/exe", O_RDONLY);
+    if (fd >= 0) {
+        if (pread(fd, &machine, sizeof(machine), 18) != sizeof(machine)) {
+            machine = 0;
+        }
+        close(fd);
+    }
+    return machine;
+}
+
+static void perf_exit(void)
+{
+    if (perfmap) {
+        fclose(perfmap);
+        perfmap = NULL;
+    }
+    if (jitdump) {
+        munmap(jitdump_marker, jitdump_marker_size);
+        fclose(jitdump);
+        jitdump = NULL;
+    }
+}
+
+static FILE *perf_open(const char *fmt)
+{
+    char path[32];
+    FILE *f;
+
+    snprintf(path, sizeof(path), fmt, getpid());
+    f = fopen(path, "w+");
+    if (!f) {
+        error_report("Could not open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (!perfmap && !jitdump) {
+        atexit(perf_exit);
+    }
+    return f;
+}
+
+void perf_enable_perfmap(void)
+{
+    FILE *f;
+
+    if (perfmap) {
+        return;
+    }
+    f = perf_open("/tmp/perf-%d.map");
+    if (f) {
+        /* "perf top" reads the map while the guest runs */
+        setvbuf(f, NULL, _IOLBF, 0);
+        perfmap = f;
+    }
+}
+
+void perf_enable_jitdump(void)
+{
+    struct jitheader header;
+    FILE *f;
+
+    if (jitdump) {
+        return;
+    }
+    f = perf_open("/tmp/jit-%d.dump");
+    if (!f) {
+        return;
+    }
+
+    /* perf finds the dump through an executable mapping of it */
+    jitdump_marker_size = qemu_real_host_page_size;
+    jitdump_marker = mmap(NULL, jitdump_marker_size, PROT_READ | PROT_EXEC,
+                          MAP_PRIVATE, fileno(f), 0);
+    if (jitdump_marker == MAP_FAILED) {
+        error_report("Could not map the jitdump: %s", strerror(errno));
+        fclose(f);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = JITHEADER_MAGIC;
+    header.version = JITHEADER_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = perf_host_elf_machine();
+    header.pid = getpid();
+    header.timestamp = perf_timestamp();
+    fwrite(&header, sizeof(header), 1, f);
+    fflush(f);
+    jitdump = f;
+}
+
+static void perf_write_jitdump(const TranslationBlock *tb, const char *name)
+{
+    struct jr_code_load record;
+    size_t name_size = strlen(name) + 1;
+
+    record.p.id = JIT_CODE_LOAD;
+    record.p.total_size = sizeof(record) + name_size + tb->tc.size;
+    record.p.timestamp = perf_timestamp();
+    record.pid = getpid();
+    record.tid = qemu_get_thread_id();
+    record.vma = (uintptr_t)tb->tc.ptr;
+    record.code_addr = (uintptr_t)tb->tc.ptr;
+    record.code_size = tb->tc.size;
+
+    /* Keep the record in one piece when vCPUs translate concurrently */
+    flockfile(jitdump);
+    record.code_index = jitdump_code_index++;
+    fwrite(&record, sizeof(record), 1, jitdump);
+    fwrite(name, name_size, 1, jitdump);
+    fwrite(tb->tc.ptr, tb->tc.size, 1, jitdump);
+    fflush(jitdump);
+    funlockfile(jitdump);
+}
+
+void perf_report_code(const TranslationBlock *tb)
+{
+    const char *symbol;
+    char *name;
+
+    if (likely(!perfmap && !jitdump)) {
+        return;
+    }
+
+    symbol = lookup_symbol(tb->pc);
+    name = g_strdup_printf("%s@0x" TARGET_FMT_lx,
+                           *symbol ? symbol : "guest", tb->pc);
+    if (perfmap) {
+        /* stdio locks the stream, so concurrent translators are fine.  */
+        fprintf(perfmap, "%" PRIxPTR " %zx %s\n",
+                (uintptr_t)tb->tc.ptr, tb->tc.size, name);
+    }
+    if (jitdump) {
+        perf_write_jitdump(tb, name);
+    }
+    g_free(name);
+}
+
+void perf_report_flush(void)
+{
+    /* The map cannot tell old code from new code at the same address,
+     * so drop the entries of the blocks that are going away.  Samples
+     * taken before the flush are then left unattributed, rather than
+     * blamed on whatever is translated next.  The jitdump is timestamped
+     * and needs nothing.
+     */
+    if (perfmap) {
+        flockfile(perfmap);
+        rewind(perfmap);
+        if (ftruncate(fileno(perfmap), 0) < 0) {
+            warn_report("Could not truncate the perf map: %s",
+                        strerror(errno));
+        }
+        funlockfile(perfmap);
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * Linux perf support for TCG generated code.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TCG_PERF_H
+#define TCG_PERF_H
+
+struct TranslationBlock;
+
+#ifdef CONFIG_LINUX
+/* Start writing /tmp/perf-<pid>.map, which lets "perf top" and
+ * "perf report" attribute samples in the code buffer to guest code.
+ */
+void perf_enable_perfmap(void);
+
+/* Start writing /tmp/jit-<pid>.dump, for "perf inject --jit".  */
+void perf_enable_jitdump(void);
+
+/* Record the host code of a freshly translated TB.  */
+void perf_report_code(const struct TranslationBlock *tb);
+
+/* The code buffer is about to be flushed.  */
+void perf_report_flush(void);
+#else
+static inline void perf_report_code(const struct TranslationBlock *tb)
+{
+}
+
+static inline void perf_report_flush(void)
+{
+}
+#endif
+
+#endif /* TCG_PERF_H */
@@ -0,0 +1,209 @@
+/*
+ * Runtime profile of TCG generated code.
+ *
+ * While the profile is enabled, every translated block starts with an
+ * increment of the execution counter for its guest PC, and every helper
+ * call is preceded by an increment of the counter for that helper.  The
+ * counters are plain memory updates rather than atomic operations, so
+ * vCPUs running in parallel may lose a few counts, but they cost
+ * next to nothing when the profile is off: no code is generated for
+ * them at all.
+ *
+ * Profiles are kept per guest PC rather than per TB, so that they
+ * survive translation cache flushes.  They are never freed, because
+ * generated code may still refer to them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg/tcg.h"
+#include "tcg/profile.h"
+#ifndef CONFIG_USER_ONLY
+#include "disas/disas.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
+#endif
+
+bool tcg_profile_enabled;
+
+static QemuMutex tcg_profile_lock;
+static GHashTable *tcg_profiles;
+
+static void __attribute__((constructor)) tcg_profile_init(void)
+{
+    qemu_mutex_init(&tcg_profile_lock);
+    tcg_profiles = g_hash_table_new(g_int64_hash, g_int64_equal);
+}
+
+TBProfile *tcg_profile_lookup(uint64_t pc)
+{
+    TBProfile *prof;
+
+    if (likely(!atomic_read(&tcg_profile_enabled))) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&tcg_profile_lock);
+    prof = g_hash_table_lookup(tcg_profiles, &pc);
+    if (!prof) {
+        prof = g_new0(TBProfile, 1);
+        prof->pc = pc;
+        g_hash_table_insert(tcg_profiles, &prof->pc, prof);
+    }
+    qemu_mutex_unlock(&tcg_profile_lock);
+    return prof;
+}
+
+void tcg_profile_translated(TBProfile *prof, int64_t ns)
+{
+    qemu_mutex_lock(&tcg_profile_lock);
+    prof->translations++;
+    prof->translate_ns += ns;
+    qemu_mutex_unlock(&tcg_profile_lock);
+}
+
+#ifndef CONFIG_USER_ONLY
+void qmp_set_tcg_profile(bool enabled, Error **errp)
+{
+    if (!tcg_enabled()) {
+        error_setg(errp, "TCG is not in use");
+        return;
+    }
+    if (enabled == atomic_read(&tcg_profile_enabled)) {
+        return;
+    }
+    atomic_set(&tcg_profile_enabled, enabled);
+
+    /* Retranslate everything with or without the counters */
+    tb_flush(first_cpu);
+}
+
+static gint tcg_profile_block_compare(gconstpointer a, gconstpointer b)
+{
+    const TBProfile *pa = a, *pb = b;
+
+    if (pa->executions != pb->executions) {
+        return pa->executions > pb->executions ? -1 : 1;
+    }
+    return pa->pc < pb->pc ? -1 : pa->pc > pb->pc;
+}
+
+static gint tcg_profile_helper_compare(gconstpointer a, gconstpointer b)
+{
+    const TcgProfileHelper *ha = a, *hb = b;
+
+    if (ha->calls != hb->calls) {
+        return ha->calls > hb->calls ? -1 : 1;
+    }
+    return strcmp(ha->name, hb->name);
+}
+
+static void tcg_profile_add_helper(const char *name, uint64_t calls,
+                                   void *opaque)
+{
+    GList **helpers = opaque;
+    TcgProfileHelper *info = g_new0(TcgProfileHelper, 1);
+
+    info->name = g_strdup(name);
+    info->calls = calls;
+    *helpers = g_list_prepend(*helpers, info);
+}
+
+TcgProfile *qmp_query_tcg_profile(bool has_limit, int64_t limit,
+                                  Error **errp)
+{
+    TcgProfile *info;
+    TcgProfileBlockList **btail;
+    TcgProfileHelperList **htail;
+    GList *blocks, *helpers = NULL, *l;
+    int64_t n = 0;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "TCG is not in use");
+        return NULL;
+    }
+    if (!has_limit) {
+        limit = 32;
+    }
+
+    info = g_new0(TcgProfile, 1);
+    info->enabled = atomic_read(&tcg_profile_enabled);
+
+    /* Copy the profiles, so that vCPUs can keep translating meanwhile */
+    qemu_mutex_lock(&tcg_profile_lock);
+    blocks = g_hash_table_get_values(tcg_profiles);
+    for (l = blocks; l; l = l->next) {
+        l->data = g_memdup(l->data, sizeof(TBProfile));
+    }
+    qemu_mutex_unlock(&tcg_profile_lock);
+
+    blocks = g_list_sort(blocks, tcg_profile_block_compare);
+    btail = &info->blocks;
+    for (l = blocks; l && n < limit; l = l->next) {
+        TBProfile *prof = l->data;
+        TcgProfileBlock *block;
+        const char *symbol;
+
+        /* Left over from before the last reset */
+        if (!prof->executions && !prof->translations) {
+            continue;
+        }
+        block = g_new0(TcgProfileBlock, 1);
+        block->pc = prof->pc;
+        symbol = lookup_symbol(prof->pc);
+        if (*symbol) {
+            block->has_symbol = true;
+            block->symbol = g_strdup(symbol);
+        }
+        block->executions = prof->executions;
+        block->translations = prof->translations;
+        block->translate_ns = prof->translate_ns;
+
+        *btail = g_new0(TcgProfileBlockList, 1);
+        (*btail)->value = block;
+        btail = &(*btail)->next;
+        n++;
+    }
+    g_list_free_full(blocks, g_free);
+
+    tcg_helper_calls_foreach(tcg_profile_add_helper, &helpers);
+    helpers = g_list_sort(helpers, tcg_profile_helper_compare);
+    htail = &info->helpers;
+    for (l = helpers; l; l = l->next) {
+        *htail = g_new0(TcgProfileHelperList, 1);
+        (*htail)->value = l->data;
+        htail = &(*htail)->next;
+    }
+    g_list_free(helpers);
+
+    return info;
+}
+
+static void tcg_profile_clear(gpointer key, gpointer value, gpointer opaque)
+{
+    TBProfile *prof = value;
+
+    prof->executions = 0;
+    prof->translations = 0;
+    prof->translate_ns = 0;
+}
+
+void qmp_reset_tcg_profile(Error **errp)
+{
+    if (!tcg_enabled()) {
+        error_setg(errp, "TCG is not in use");
+        return;
+    }
+
+    qemu_mutex_lock(&tcg_profile_lock);
+    g_hash_table_foreach(tcg_profiles, tcg_profile_clear, NULL);
+    tcg_helper_calls_reset();
+    qemu_mutex_unlock(&tcg_profile_lock);
+}
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Runtime profile of TCG generated code.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TCG_PROFILE_H
+#define TCG_PROFILE_H
+
+typedef struct TBProfile {
+    uint64_t pc;
+    uint64_t executions;    /* updated by generated code */
+    uint64_t translations;
+    uint64_t translate_ns;
+} TBProfile;
+
+extern bool tcg_profile_enabled;
+
+/* Return the profile of the blocks starting at @pc, or NULL if the
+ * profile is not being collected.  The result stays valid forever.
+ */
+TBProfile *tcg_profile_lookup(uint64_t pc);
+
+/* A block of @prof was translated in @ns nanoseconds.  */
+void tcg_profile_translated(TBProfile *prof, int64_t ns);
+
+#endif /* TCG_PROFILE_H */
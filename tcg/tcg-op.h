@@ -822,6 +822,14 @@ void tcg_gen_goto_tb(unsigned idx);
  */
 void tcg_gen_lookup_and_goto_ptr(void);
 
+/**
+ * tcg_gen_profile_count() - increment a profiling counter
+ * @counter: host address of the counter
+ *
+ * The increment is not atomic, so concurrent updates may be lost.
+ */
+void tcg_gen_profile_count(uint64_t *counter);
+
 #if TARGET_LONG_BITS == 32
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
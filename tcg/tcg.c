@@ -879,12 +879,31 @@ static const TCGHelperInfo all_helpers[] = {
 #include "exec/helper-tcg.h"
 };
 static GHashTable *helper_table;
+static uint64_t helper_calls[ARRAY_SIZE(all_helpers)];
 
 static int indirect_reg_alloc_order[ARRAY_SIZE(tcg_target_reg_alloc_order)];
 static void process_op_defs(TCGContext *s);
 static TCGTemp *tcg_global_reg_new_internal(TCGContext *s, TCGType type,
                                             TCGReg reg, const char *name);
 
+void tcg_helper_calls_foreach(TCGHelperCallsFunc *fn, void *opaque)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(all_helpers); ++i) {
+        uint64_t calls = helper_calls[i];
+
+        if (calls) {
+            fn(all_helpers[i].name, calls, opaque);
+        }
+    }
+}
+
+void tcg_helper_calls_reset(void)
+{
+    memset(helper_calls, 0, sizeof(helper_calls));
+}
+
 void tcg_context_init(TCGContext *s)
 {
     int op, total_args, n, i;
@@ -1625,6 +1644,10 @@ void tcg_gen_callN(void *func, TCGTemp *ret, int nargs, TCGTemp **args)
     flags = info->flags;
     sizemask = info->sizemask;
 
+    if (tcg_ctx->tb_exec_count) {
+        tcg_gen_profile_count(&helper_calls[info - all_helpers]);
+    }
+
 #if defined(__sparc__) && !defined(__arch64__) \
     && !defined(CONFIG_TCG_INTERPRETER)
     /* We have 64-bit values in one register, but need to pass as two
@@ -710,6 +710,9 @@ struct TCGContext {
 
     TCGLabel *exitreq_label;
 
+    /* Execution counter of the TB being translated, when profiling */
+    uint64_t *tb_exec_count;
+
     TCGTempSet free_temps[TCG_TYPE_COUNT * 2];
     TCGTemp temps[TCG_MAX_TEMPS]; /* globals first, temps after */
 
@@ -903,6 +906,12 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
 
+/* Calls to each helper counted while profiling, see tcg/profile.c */
+typedef void TCGHelperCallsFunc(const char *name, uint64_t calls,
+                                void *opaque);
+void tcg_helper_calls_foreach(TCGHelperCallsFunc *fn, void *opaque);
+void tcg_helper_calls_reset(void);
+
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
 TCGTemp *tcg_global_mem_new_internal(TCGType, TCGv_ptr,
@@ -1454,8 +1463,9 @@ GEN_ATOMIC_HELPER_ALL(xchg)
 #undef GEN_ATOMIC_HELPER
 #endif /* CONFIG_SOFTMMU */
 
-#ifdef CONFIG_ATOMIC128
-#include "qemu/int128.h"
+#include "qemu/atomic128.h"
+
+#ifdef HAVE_ATOMIC128
 
 /* These aren't really a "proper" helpers because TCG cannot manage Int128.
    However, use the same format as the others, for use by the backends. */
@@ -1475,6 +1485,6 @@ void helper_atomic_sto_le_mmu(CPUArchState *env, target_ulong addr, Int128 val,
 void helper_atomic_sto_be_mmu(CPUArchState *env, target_ulong addr, Int128 val,
                               TCGMemOpIdx oi, uintptr_t retaddr);
 
-#endif /* CONFIG_ATOMIC128 */
+#endif /* HAVE_ATOMIC128 */
 
 #endif /* TCG_H */
@@ -0,0 +1,108 @@
+/*
+ * VMState save speed benchmark
+ *
+ * Saves the state of many devices, as done while the guest is stopped
+ * at the end of migration, with and without the JSON description of
+ * the stream.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "../migration/migration.h"
+#include "migration/vmstate.h"
+#include "../migration/qemu-file.h"
+#include "../migration/qemu-file-channel.h"
+#include "../migration/qjson.h"
+#include "io/channel-file.h"
+
+#define BENCH_DEVICES 1000
+
+typedef struct BenchDevice {
+    uint32_t regs[64];
+    uint8_t  config[256];
+    uint8_t  irq_level;
+    uint8_t  irq_mask;
+    uint8_t  fifo[16];
+    uint64_t counters[8];
+    uint16_t status;
+    bool     enabled;
+} BenchDevice;
+
+static const VMStateDescription vmstate_bench_device = {
+    .name = "bench/device",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, BenchDevice, 64),
+        VMSTATE_BUFFER(config, BenchDevice),
+        VMSTATE_UINT8(irq_level, BenchDevice),
+        VMSTATE_UINT8(irq_mask, BenchDevice),
+        VMSTATE_UINT8_ARRAY(fifo, BenchDevice, 16),
+        VMSTATE_UINT64_ARRAY(counters, BenchDevice, 8),
+        VMSTATE_UINT16(status, BenchDevice),
+        VMSTATE_BOOL(enabled, BenchDevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_vmstate_save_speed(const void *opaque)
+{
+    bool with_vmdesc = (bool)(uintptr_t)opaque;
+    BenchDevice *devs = g_new0(BenchDevice, BENCH_DEVICES);
+    QIOChannel *ioc;
+    QEMUFile *f;
+    uint64_t saves = 0;
+    int i;
+
+    ioc = QIO_CHANNEL(qio_channel_file_new_path("/dev/null", O_WRONLY, 0,
+                                                &error_abort));
+    f = qemu_fopen_channel_output(ioc);
+
+    g_test_timer_start();
+    do {
+        QJSON *vmdesc = with_vmdesc ? qjson_new() : NULL;
+
+        for (i = 0; i < BENCH_DEVICES; i++) {
+            if (vmdesc) {
+                json_start_object(vmdesc, NULL);
+            }
+            g_assert(!vmstate_save_state(f, &vmstate_bench_device, &devs[i],
+                                         vmdesc));
+            if (vmdesc) {
+                json_end_object(vmdesc);
+            }
+        }
+        qemu_fflush(f);
+        if (vmdesc) {
+            qjson_finish(vmdesc);
+            qjson_destroy(vmdesc);
+        }
+        saves++;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    g_print("%s vmdesc: ", with_vmdesc ? "with" : "without");
+    g_print("%d devices saved %" PRIu64 " times in %.2f secs: ",
+            BENCH_DEVICES, saves, g_test_timer_last());
+    g_print("%.2f us per save\n", g_test_timer_last() * 1e6 / saves);
+
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+    object_unref(OBJECT(ioc));
+    g_free(devs);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/vmstate/save/speed", (void *)false,
+                         test_vmstate_save_speed);
+    g_test_add_data_func("/vmstate/save/vmdesc/speed", (void *)true,
+                         test_vmstate_save_speed);
+
+    return g_test_run();
+}
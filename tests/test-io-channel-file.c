@@ -91,6 +91,55 @@ static void test_io_channel_fd(void)
 }
 
 
+#ifdef CONFIG_PREADV
+static void test_io_channel_file_pwritev(void)
+{
+    QIOChannel *ioc;
+    char head[] = "head", tail[] = "tail";
+    char buf[8];
+    struct iovec iov[2];
+    Error *err = NULL;
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(
+                          TEST_FILE,
+                          O_RDWR | O_CREAT | O_TRUNC | O_BINARY, TEST_MASK,
+                          &error_abort));
+
+    /* Out of order, leaving a hole in between */
+    iov[0] = (struct iovec) { .iov_base = tail, .iov_len = 4 };
+    g_assert_cmpint(qio_channel_pwritev_all(ioc, iov, 1, 4096,
+                                            &error_abort), ==, 0);
+    iov[0] = (struct iovec) { .iov_base = head, .iov_len = 4 };
+    g_assert_cmpint(qio_channel_pwritev_all(ioc, iov, 1, 0,
+                                            &error_abort), ==, 0);
+
+    /* The I/O position was not moved */
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 0);
+
+    iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 2 };
+    iov[1] = (struct iovec) { .iov_base = buf + 2, .iov_len = 2 };
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 2, 0,
+                                           &error_abort), ==, 0);
+    g_assert(memcmp(buf, head, 4) == 0);
+    iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 4 };
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 1, 4096,
+                                           &error_abort), ==, 0);
+    g_assert(memcmp(buf, tail, 4) == 0);
+
+    /* Reading past the end is an error */
+    iov[0] = (struct iovec) { .iov_base = buf, .iov_len = 8 };
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 1, 4096, &err), ==, -1);
+    g_assert(err);
+    error_free(err);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+#endif /* CONFIG_PREADV */
+
+
 #ifndef _WIN32
 static void test_io_channel_pipe(bool async)
 {
@@ -136,6 +185,9 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+#ifdef CONFIG_PREADV
+    g_test_add_func("/io/channel/file/pwritev", test_io_channel_file_pwritev);
+#endif
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
@@ -263,6 +263,61 @@ static void test_io_channel_ipv4_async(void)
 }
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    size_t len = 16 * 1024;
+    char *sendbuf = g_malloc(len);
+    char *recvbuf = g_malloc0(len);
+    struct iovec iov = { .iov_base = sendbuf, .iov_len = len };
+    size_t i;
+
+    listen_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    listen_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    connect_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    if (!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        g_test_skip("MSG_ZEROCOPY is not supported");
+        goto cleanup;
+    }
+
+    for (i = 0; i < len; i++) {
+        sendbuf[i] = i % 251;
+    }
+
+    g_assert_cmpint(qio_channel_writev_full_all(
+                        src, &iov, 1, NULL, 0,
+                        QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                        &error_abort), ==, 0);
+    g_assert_cmpint(qio_channel_read_all(dst, recvbuf, len, &error_abort),
+                    ==, 0);
+    g_assert(memcmp(sendbuf, recvbuf, len) == 0);
+
+    /* Loopback traffic may well have been copied, but it must complete */
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), >=, 0);
+
+ cleanup:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    g_free(sendbuf);
+    g_free(recvbuf);
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
 static void test_io_channel_ipv6(bool async)
 {
     SocketAddress *listen_addr = g_new0(SocketAddress, 1);
@@ -377,6 +432,7 @@ static void test_io_channel_unix_fd_pass(void)
                             G_N_ELEMENTS(iosend),
                             fdsend,
                             G_N_ELEMENTS(fdsend),
+                            0,
                             &error_abort);
 
     qio_channel_readv_full(dst,
@@ -509,6 +565,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
@@ -0,0 +1,163 @@
+/*
+ * Multifd compression methods unit tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "../migration/multifd-compress.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_COUNT 16
+#define PACKETS 8
+
+/* A mix of zero, repetitive, text-like and random pages */
+static void fill_page(uint8_t *page, unsigned packet, unsigned i)
+{
+    unsigned j;
+
+    switch ((packet + i) % 4) {
+    case 0:
+        memset(page, 0, PAGE_SIZE);
+        break;
+    case 1:
+        memset(page, packet * PAGE_COUNT + i, PAGE_SIZE);
+        break;
+    case 2:
+        for (j = 0; j < PAGE_SIZE; j++) {
+            page[j] = "multifd compression "[j % 20] + packet;
+        }
+        break;
+    default:
+        for (j = 0; j < PAGE_SIZE; j++) {
+            page[j] = g_test_rand_int();
+        }
+        break;
+    }
+}
+
+static void test_round_trip(gconstpointer opaque)
+{
+    MultiFDCompression method = GPOINTER_TO_INT(opaque);
+    const MultiFDMethods *methods = multifd_compress_methods(method);
+    uint8_t *src = g_malloc(PAGE_COUNT * PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_COUNT * PAGE_SIZE);
+    struct iovec src_iov[PAGE_COUNT], dst_iov[PAGE_COUNT];
+    void *send, *recv = NULL;
+    unsigned packet, i;
+
+    g_assert(methods);
+    g_assert(multifd_compression_supported(method));
+
+    send = methods->send_setup(PAGE_COUNT, PAGE_SIZE, 1, &error_abort);
+    g_assert(send);
+    if (methods->recv_setup) {
+        recv = methods->recv_setup(&error_abort);
+        g_assert(recv);
+    }
+
+    for (i = 0; i < PAGE_COUNT; i++) {
+        src_iov[i].iov_base = src + i * PAGE_SIZE;
+        src_iov[i].iov_len = PAGE_SIZE;
+        dst_iov[i].iov_base = dst + i * PAGE_SIZE;
+        dst_iov[i].iov_len = PAGE_SIZE;
+    }
+
+    /* Streams carry state from one packet to the next one */
+    for (packet = 0; packet < PACKETS; packet++) {
+        unsigned num = packet % PAGE_COUNT + 1;
+        uint8_t *buf;
+        uint32_t len;
+
+        for (i = 0; i < num; i++) {
+            fill_page(src_iov[i].iov_base, packet, i);
+        }
+        memset(dst, 0xaa, PAGE_COUNT * PAGE_SIZE);
+
+        g_assert_cmpint(methods->send_prepare(send, src_iov, num, &buf, &len,
+                                              &error_abort), ==, 0);
+        g_assert_cmpuint(len, <=, MULTIFD_COMPRESS_MAX(num, PAGE_SIZE));
+        g_assert_cmpint(methods->recv_pages(recv, buf, len, dst_iov, num,
+                                            &error_abort), ==, 0);
+        g_assert(memcmp(src, dst, num * PAGE_SIZE) == 0);
+    }
+
+    methods->send_cleanup(send);
+    if (recv) {
+        methods->recv_cleanup(recv);
+    }
+    g_free(src);
+    g_free(dst);
+}
+
+static void test_truncated(gconstpointer opaque)
+{
+    MultiFDCompression method = GPOINTER_TO_INT(opaque);
+    const MultiFDMethods *methods = multifd_compress_methods(method);
+    uint8_t *src = g_malloc(PAGE_COUNT * PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_COUNT * PAGE_SIZE);
+    struct iovec src_iov[PAGE_COUNT], dst_iov[PAGE_COUNT];
+    void *send, *recv = NULL;
+    Error *err = NULL;
+    uint8_t *buf;
+    uint32_t len;
+    unsigned i;
+
+    send = methods->send_setup(PAGE_COUNT, PAGE_SIZE, 1, &error_abort);
+    if (methods->recv_setup) {
+        recv = methods->recv_setup(&error_abort);
+    }
+    for (i = 0; i < PAGE_COUNT; i++) {
+        src_iov[i].iov_base = src + i * PAGE_SIZE;
+        src_iov[i].iov_len = PAGE_SIZE;
+        dst_iov[i].iov_base = dst + i * PAGE_SIZE;
+        dst_iov[i].iov_len = PAGE_SIZE;
+        fill_page(src_iov[i].iov_base, 0, i);
+    }
+
+    g_assert_cmpint(methods->send_prepare(send, src_iov, PAGE_COUNT, &buf,
+                                          &len, &error_abort), ==, 0);
+    g_assert_cmpint(methods->recv_pages(recv, buf, len / 2, dst_iov,
+                                        PAGE_COUNT, &err), ==, -1);
+    g_assert(err);
+    error_free(err);
+
+    methods->send_cleanup(send);
+    if (recv) {
+        methods->recv_cleanup(recv);
+    }
+    g_free(src);
+    g_free(dst);
+}
+
+static void add_tests(const char *name, MultiFDCompression method)
+{
+    char *path;
+
+    path = g_strdup_printf("/multifd-compress/%s/round-trip", name);
+    g_test_add_data_func(path, GINT_TO_POINTER(method), test_round_trip);
+    g_free(path);
+    path = g_strdup_printf("/multifd-compress/%s/truncated", name);
+    g_test_add_data_func(path, GINT_TO_POINTER(method), test_truncated);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_rand_int();
+
+    g_assert(multifd_compression_supported(MULTIFD_COMPRESSION_NONE));
+    g_assert(!multifd_compress_methods(MULTIFD_COMPRESSION_NONE));
+
+    add_tests("zlib", MULTIFD_COMPRESSION_ZLIB);
+#ifdef CONFIG_ZSTD
+    add_tests("zstd", MULTIFD_COMPRESSION_ZSTD);
+#endif
+#ifdef CONFIG_LZ4
+    add_tests("lz4", MULTIFD_COMPRESSION_LZ4);
+#endif
+    return g_test_run();
+}
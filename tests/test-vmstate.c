@@ -355,6 +355,101 @@ static void test_load_v2(void)
     qemu_fclose(loading);
 }
 
+/* Byte fields at contiguous offsets are moved as a single run */
+
+typedef struct TestBytes {
+    uint8_t  a;
+    uint8_t  arr[3];
+    int8_t   b;
+    uint8_t  c;
+    uint8_t  buf[4];
+    uint32_t d;
+    uint8_t  e;
+} TestBytes;
+
+static const VMStateDescription vmstate_bytes = {
+    .name = "test/bytes",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(a, TestBytes),
+        VMSTATE_UINT8_ARRAY(arr, TestBytes, 3),
+        VMSTATE_INT8(b, TestBytes),
+        VMSTATE_UINT8_V(c, TestBytes, 2),
+        VMSTATE_BUFFER(buf, TestBytes),
+        VMSTATE_UINT32(d, TestBytes),
+        VMSTATE_UINT8(e, TestBytes),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+TestBytes obj_bytes = {
+    .a = 1,
+    .arr = { 2, 3, 4 },
+    .b = -5,
+    .c = 6,
+    .buf = { 7, 8, 9, 10 },
+    .d = 70000,
+    .e = 11,
+};
+
+uint8_t wire_bytes[] = {
+    /* a */     0x01,
+    /* arr */   0x02, 0x03, 0x04,
+    /* b */     0xfb,
+    /* c */     0x06,
+    /* buf */   0x07, 0x08, 0x09, 0x0a,
+    /* d */     0x00, 0x01, 0x11, 0x70,
+    /* e */     0x0b,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_bytes_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestBytes));
+}
+
+static void test_bytes(void)
+{
+    TestBytes obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_bytes, &obj_bytes);
+
+    compare_vmstate(wire_bytes, sizeof(wire_bytes));
+
+    SUCCESS(load_vmstate(&vmstate_bytes, &obj, &obj_clone,
+                         obj_bytes_copy, 2, wire_bytes, sizeof(wire_bytes)));
+    SUCCESS(memcmp(&obj, &obj_bytes, sizeof(obj)));
+}
+
+static void test_bytes_load_v1(void)
+{
+    uint8_t buf[] = {
+        1,                       /* a */
+        2, 3, 4,                 /* arr */
+        0xfb,                    /* b */
+        7, 8, 9, 10,             /* buf */
+        0, 0, 0, 40,             /* d */
+        11,                      /* e */
+        QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+    };
+    save_buffer(buf, sizeof(buf));
+
+    QEMUFile *loading = open_test_file(false);
+    TestBytes obj = { .c = 200 };
+    vmstate_load_state(loading, &vmstate_bytes, &obj, 1);
+    g_assert(!qemu_file_get_error(loading));
+    g_assert_cmpint(obj.a, ==, 1);
+    g_assert_cmpint(obj.arr[2], ==, 4);
+    g_assert_cmpint(obj.b, ==, -5);
+    g_assert_cmpint(obj.c, ==, 200);
+    g_assert_cmpint(obj.buf[3], ==, 10);
+    g_assert_cmpint(obj.d, ==, 40);
+    g_assert_cmpint(obj.e, ==, 11);
+    qemu_fclose(loading);
+}
+
 static bool test_skip(void *opaque, int version_id)
 {
     TestStruct *t = (TestStruct *)opaque;
@@ -863,6 +958,8 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
+    g_test_add_func("/vmstate/bytes", test_bytes);
+    g_test_add_func("/vmstate/bytes/load/v1", test_bytes_load_v1);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
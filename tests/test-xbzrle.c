@@ -174,6 +174,74 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 64
+
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_PAGES];
+    bool first = true;
+    int i, j;
+
+    /* random runs of equal and different bytes, of any length/alignment */
+    for (i = 0; i < ACCEL_PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, ACCEL_PAGES * PAGE_SIZE);
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        int max = 1 << g_test_rand_int_range(0, 10);
+
+        j = g_test_rand_int_range(0, max);
+        while (j < PAGE_SIZE) {
+            int len = g_test_rand_int_range(1, max + 1);
+
+            for (; len && j < PAGE_SIZE; len--, j++) {
+                new[i * PAGE_SIZE + j] = ~old[i * PAGE_SIZE + j];
+            }
+            j += g_test_rand_int_range(1, max + 1);
+        }
+    }
+
+    /* every variant must produce exactly the same stream */
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            int dlen = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                            new + i * PAGE_SIZE, PAGE_SIZE,
+                                            compressed, PAGE_SIZE);
+
+            if (first) {
+                ref_len[i] = dlen;
+                if (dlen > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, dlen);
+                }
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i]);
+                if (dlen > 0) {
+                    g_assert(memcmp(ref + i * PAGE_SIZE, compressed,
+                                    dlen) == 0);
+                }
+            }
+
+            if (dlen > 0) {
+                memcpy(test, old + i * PAGE_SIZE, PAGE_SIZE);
+                xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+                g_assert(memcmp(test, new + i * PAGE_SIZE, PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +254,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -38,6 +38,8 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
+#include "qemu/units.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -59,12 +61,21 @@
 #include "qemu/error-report.h"
 #endif
 
-#define MAX_MEM_PREALLOC_THREAD_COUNT 16
+#define MAX_MEM_PREALLOC_THREAD_COUNT 64
+
+/*
+ * Unit of work handed out to the populate threads: small enough to balance
+ * the load and to report progress, large enough to keep the number of
+ * madvise() calls low.
+ */
+#define MEM_PREALLOC_CHUNK (128 * MiB)
 
 struct MemsetThread {
     char *addr;
     size_t numpages;
     size_t hpagesize;
+    const unsigned long *host_cpus;
+    unsigned long nbits;
     QemuThread pgthread;
     sigjmp_buf env;
 };
@@ -74,6 +85,21 @@ static MemsetThread *memset_thread;
 static int memset_num_threads;
 static bool memset_thread_failed;
 
+struct MemPrealloc {
+    char *area;
+    size_t size;
+    size_t chunk;
+    unsigned long *host_cpus;
+    unsigned long nbits;
+    int num_threads;
+    QemuThread *threads;
+
+    /* Updated atomically by the populate threads */
+    size_t next;
+    size_t populated;
+    int err;
+};
+
 int qemu_get_thread_id(void)
 {
 #if defined(__linux__)
@@ -312,6 +338,15 @@ static void *do_touch_pages(void *arg)
     MemsetThread *memset_args = (MemsetThread *)arg;
     sigset_t set, oldset;
 
+    /* Fault the pages in from CPUs that are close to the memory */
+    if (memset_args->host_cpus) {
+        QemuThread self;
+
+        qemu_thread_get_self(&self);
+        qemu_thread_set_affinity(&self, memset_args->host_cpus,
+                                 memset_args->nbits);
+    }
+
     /* unblock SIGBUS */
     sigemptyset(&set);
     sigaddset(&set, SIGBUS);
@@ -345,20 +380,30 @@ static void *do_touch_pages(void *arg)
     return NULL;
 }
 
-static inline int get_memset_num_threads(int smp_cpus)
+static inline int get_memset_num_threads(int max_threads,
+                                         const unsigned long *host_cpus,
+                                         unsigned long nbits)
 {
     long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
     int ret = 1;
 
+    if (host_cpus) {
+        host_procs = bitmap_count_one(host_cpus, nbits);
+    }
+
     if (host_procs > 0) {
-        ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), smp_cpus);
+        ret = MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT);
+        if (max_threads > 0) {
+            ret = MIN(ret, max_threads);
+        }
     }
     /* In case sysconf() fails, we fall back to single threaded */
     return ret;
 }
 
 static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                            int smp_cpus)
+                            int max_threads, const unsigned long *host_cpus,
+                            unsigned long nbits)
 {
     size_t numpages_per_thread;
     size_t size_per_thread;
@@ -366,7 +411,8 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     int i = 0;
 
     memset_thread_failed = false;
-    memset_num_threads = get_memset_num_threads(smp_cpus);
+    memset_num_threads = get_memset_num_threads(max_threads, host_cpus,
+                                                nbits);
     memset_thread = g_new0(MemsetThread, memset_num_threads);
     numpages_per_thread = (numpages / memset_num_threads);
     size_per_thread = (hpagesize * numpages_per_thread);
@@ -375,6 +421,8 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
         memset_thread[i].numpages = (i == (memset_num_threads - 1)) ?
                                     numpages : numpages_per_thread;
         memset_thread[i].hpagesize = hpagesize;
+        memset_thread[i].host_cpus = host_cpus;
+        memset_thread[i].nbits = nbits;
         qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
                            do_touch_pages, &memset_thread[i],
                            QEMU_THREAD_JOINABLE);
@@ -390,8 +438,10 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     return memset_thread_failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
-                     Error **errp)
+static void os_mem_prealloc_touch(int fd, char *area, size_t memory,
+                                  int max_threads,
+                                  const unsigned long *host_cpus,
+                                  unsigned long nbits, Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
@@ -410,7 +460,8 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 
     /* touch pages simultaneously */
-    if (touch_all_pages(area, hpagesize, numpages, smp_cpus)) {
+    if (touch_all_pages(area, hpagesize, numpages, max_threads,
+                        host_cpus, nbits)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM");
     }
@@ -423,6 +474,132 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+static void *do_populate_pages(void *arg)
+{
+    MemPrealloc *p = arg;
+
+    if (p->host_cpus) {
+        QemuThread self;
+
+        qemu_thread_get_self(&self);
+        qemu_thread_set_affinity(&self, p->host_cpus, p->nbits);
+    }
+
+    while (!atomic_read(&p->err)) {
+        size_t offset = atomic_fetch_add(&p->next, p->chunk);
+        size_t len;
+
+        if (offset >= p->size) {
+            break;
+        }
+        len = MIN(p->chunk, p->size - offset);
+        if (qemu_madvise(p->area + offset, len, QEMU_MADV_POPULATE_WRITE)) {
+            atomic_cmpxchg(&p->err, 0, errno);
+            break;
+        }
+        atomic_add(&p->populated, len);
+    }
+    return NULL;
+}
+
+MemPrealloc *os_mem_prealloc_start(int fd, char *area, size_t memory,
+                                   int max_threads,
+                                   const unsigned long *host_cpus,
+                                   unsigned long nbits, Error **errp)
+{
+    Error *local_err = NULL;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    MemPrealloc *p;
+    size_t nchunks;
+    int i;
+
+    p = g_new0(MemPrealloc, 1);
+    p->area = area;
+    p->size = memory;
+
+    /*
+     * MADV_POPULATE_WRITE faults the pages in without reading or writing
+     * them, so it is safe to let it run while devices (or an incoming
+     * migration) already write to guest RAM.  Probe it on the first page;
+     * the touch loop is only safe if nothing else uses the memory yet.
+     */
+    if (qemu_madvise(area, MIN(hpagesize, memory), QEMU_MADV_POPULATE_WRITE)) {
+        if (errno != EINVAL) {
+            error_setg_errno(errp, errno, "os_mem_prealloc: Insufficient "
+                             "free host memory pages available to allocate "
+                             "guest RAM");
+            g_free(p);
+            return NULL;
+        }
+        os_mem_prealloc_touch(fd, area, memory, max_threads,
+                              host_cpus, nbits, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            g_free(p);
+            return NULL;
+        }
+        p->populated = memory;
+        return p;
+    }
+
+    p->chunk = QEMU_ALIGN_UP(MEM_PREALLOC_CHUNK, hpagesize);
+    p->next = MIN(hpagesize, memory);
+    p->populated = p->next;
+    if (host_cpus) {
+        p->host_cpus = bitmap_new(nbits);
+        bitmap_copy(p->host_cpus, host_cpus, nbits);
+        p->nbits = nbits;
+    }
+
+    nchunks = DIV_ROUND_UP(memory - p->next, p->chunk);
+    p->num_threads = MIN(get_memset_num_threads(max_threads, host_cpus, nbits),
+                         nchunks);
+    p->threads = g_new0(QemuThread, p->num_threads);
+    for (i = 0; i < p->num_threads; i++) {
+        qemu_thread_create(&p->threads[i], "populate_pages",
+                           do_populate_pages, p, QEMU_THREAD_JOINABLE);
+    }
+    return p;
+}
+
+size_t os_mem_prealloc_progress(MemPrealloc *p)
+{
+    return atomic_read(&p->populated);
+}
+
+void os_mem_prealloc_finish(MemPrealloc *p, Error **errp)
+{
+    int i;
+
+    for (i = 0; i < p->num_threads; i++) {
+        qemu_thread_join(&p->threads[i]);
+    }
+    if (p->err) {
+        error_setg_errno(errp, p->err, "os_mem_prealloc: Insufficient "
+                         "free host memory pages available to allocate "
+                         "guest RAM");
+    }
+    g_free(p->threads);
+    g_free(p->host_cpus);
+    g_free(p);
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     const unsigned long *host_cpus, unsigned long nbits,
+                     Error **errp)
+{
+    Error *local_err = NULL;
+    MemPrealloc *p;
+
+    p = os_mem_prealloc_start(fd, area, memory, max_threads,
+                              host_cpus, nbits, &local_err);
+    if (!p) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    os_mem_prealloc_finish(p, errp);
+}
+
 
 char *qemu_get_pid_name(pid_t pid)
 {
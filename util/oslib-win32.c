@@ -539,7 +539,8 @@ int getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     const unsigned long *host_cpus, unsigned long nbits,
                      Error **errp)
 {
     int i;
@@ -551,6 +552,39 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+struct MemPrealloc {
+    size_t size;
+};
+
+MemPrealloc *os_mem_prealloc_start(int fd, char *area, size_t memory,
+                                   int max_threads,
+                                   const unsigned long *host_cpus,
+                                   unsigned long nbits, Error **errp)
+{
+    Error *local_err = NULL;
+    MemPrealloc *p;
+
+    os_mem_prealloc(fd, area, memory, max_threads, host_cpus, nbits,
+                    &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    p = g_new0(MemPrealloc, 1);
+    p->size = memory;
+    return p;
+}
+
+size_t os_mem_prealloc_progress(MemPrealloc *p)
+{
+    return p->size;
+}
+
+void os_mem_prealloc_finish(MemPrealloc *p, Error **errp)
+{
+    g_free(p);
+}
+
 
 char *qemu_get_pid_name(pid_t pid)
 {
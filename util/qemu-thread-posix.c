@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/bitops.h"
 #include "qemu/notify.h"
 #include "qemu-thread-common.h"
 
@@ -547,6 +548,27 @@ void qemu_thread_get_self(QemuThread *thread)
     thread->thread = pthread_self();
 }
 
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t set;
+    unsigned long cpu;
+
+    CPU_ZERO(&set);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return -pthread_setaffinity_np(thread->thread, sizeof(set), &set);
+#else
+    return -ENOSYS;
+#endif
+}
+
 bool qemu_thread_is_self(QemuThread *thread)
 {
    return pthread_equal(pthread_self(), thread->thread);
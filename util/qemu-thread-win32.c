@@ -421,6 +421,13 @@ void qemu_thread_get_self(QemuThread *thread)
     thread->tid = GetCurrentThreadId();
 }
 
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+    return -ENOSYS;
+}
+
 HANDLE qemu_thread_get_handle(QemuThread *thread)
 {
     QemuThreadData *data;
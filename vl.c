@@ -75,6 +75,7 @@ int main(int argc, char **argv)
 #include "ui/input.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/numa.h"
+#include "sysemu/hostmem.h"
 #include "exec/gdbstub.h"
 #include "qemu/timer.h"
 #include "chardev/char.h"
@@ -304,6 +305,21 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "perfmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "Write a perf map of TCG generated code",
+        },
+        {
+            .name = "jitdump",
+            .type = QEMU_OPT_BOOL,
+            .help = "Write a perf jitdump of TCG generated code",
+        },
+        {
+            .name = "dirty-ring-size",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of entries of the per-vCPU KVM dirty ring",
+        },
         { /* end of list */ }
     },
 };
@@ -4512,6 +4528,14 @@ int main(int argc, char **argv, char **envp)
     /* do monitor/qmp handling at preconfig state if requested */
     main_loop();
 
+    /*
+     * Guest RAM must be fully populated before the board, its devices or
+     * an incoming migration write to it; on hugetlbfs a write racing with
+     * population could otherwise fault with SIGBUS instead of failing
+     * cleanly here.
+     */
+    host_memory_backend_prealloc_wait();
+
     /* from here on runstate is RUN_STATE_PRELAUNCH */
     machine_run_board_init(current_machine);
 